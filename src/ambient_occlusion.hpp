@@ -0,0 +1,162 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "bvh.hpp"
+#include "geom.hpp"
+#include "indexed_mesh.hpp"
+#include "models.hpp"
+
+#define AO_DEFAULT_SAMPLES 64
+#define AO_DEFAULT_SEED 1
+// Occluders further than this fraction of the model's bounding radius don't
+// darken anything.
+#define AO_MAX_DISTANCE 0.5
+// Rays start this fraction of the bounding radius above the surface.
+#define AO_BIAS 1e-4
+// Vertices a thread takes from the shared counter at a time.
+#define AO_CHUNK_VERTICES 256
+
+// Bakes ambient occlusion into the corners of a model at load time, so
+// lighting only scales by it and pays nothing per frame for the rays.
+class AmbientOcclusion {
+ public:
+  // Every LOD is baked against its own faces. `samples` is rounded to a
+  // square grid of strata, and the result only depends on `seed` and the
+  // mesh, not on the thread count.
+  static void bakeModel(Object3D& model, size_t samples, uint64_t seed) {
+    const auto start = std::chrono::steady_clock::now();
+    const size_t grid = std::max<size_t>(1, (size_t)std::lround(std::sqrt((double)samples)));
+    const float distance = (float)(model.boundsRadius * AO_MAX_DISTANCE);
+    const float bias = (float)(model.boundsRadius * AO_BIAS);
+    const size_t threads = std::max(1u, std::thread::hardware_concurrency());
+
+    size_t vertexCount = 0;
+    double visibleSum = 0;
+    for (size_t lod = 0; lod < model.getLodCount(); ++lod) {
+      bakeFaces(model.getFaces(lod), grid, seed, distance, bias, threads, vertexCount, visibleSum);
+    }
+    std::cout << "Ambient occlusion: " << vertexCount << " vertices in " << model.getLodCount() << " LODs, "
+              << grid * grid << " samples, " << threads << " threads, mean visibility "
+              << visibleSum / std::max<size_t>(vertexCount, 1) << ", "
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+              << " ms" << std::endl;
+  }
+
+ private:
+  static void bakeFaces(faceList_t& faces, size_t grid, uint64_t seed, float distance, float bias,
+                        size_t threads, size_t& vertexCount, double& visibleSum) {
+    const IndexedMesh mesh = IndexedMesh::fromFaces(faces);
+    const TriangleBvh bvh(faces);
+    std::vector<float> visibility(mesh.getVertexCount(), 1.0f);
+
+    // Threads take chunks of vertices as they finish, vertices near dense
+    // geometry cost many more traversal steps than open ones.
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+      for (;;) {
+        const size_t begin = next.fetch_add(AO_CHUNK_VERTICES);
+        if (begin >= visibility.size()) return;
+        const size_t end = std::min(begin + AO_CHUNK_VERTICES, visibility.size());
+        for (size_t v = begin; v < end; ++v) {
+          visibility[v] = bakeVertex(bvh, mesh.positions[v], mesh.normals[v], grid, seed, distance, bias);
+        }
+      }
+    };
+    std::vector<std::future<void>> jobs;
+    for (size_t t = 1; t < threads; ++t) jobs.push_back(std::async(std::launch::async, work));
+    work();
+    for (std::future<void>& pending : jobs) pending.get();
+
+    for (size_t f = 0; f < faces.size(); ++f) {
+      faces[f].ao0 = visibility[mesh.indices[f * 3]];
+      faces[f].ao1 = visibility[mesh.indices[f * 3 + 1]];
+      faces[f].ao2 = visibility[mesh.indices[f * 3 + 2]];
+    }
+    vertexCount += visibility.size();
+    for (float value : visibility) visibleSum += value;
+  }
+
+  // Fraction of `grid` x `grid` cosine weighted rays over the hemisphere of
+  // `normal` that leave without hitting anything, one jittered ray per
+  // stratum of the unit square.
+  static float bakeVertex(const TriangleBvh& bvh, const dVector3D& position, const dVector3D& normal,
+                          size_t grid, uint64_t seed, float distance, float bias) {
+    const double length = !normal;
+    if (length <= 0) return 1.0f;
+    const float n[3] = {(float)(normal.x() / length), (float)(normal.y() / length), (float)(normal.z() / length)};
+    float tangent[3], bitangent[3];
+    getBasis(n, tangent, bitangent);
+    const float origin[3] = {(float)position.x() + n[0] * bias, (float)position.y() + n[1] * bias,
+                             (float)position.z() + n[2] * bias};
+
+    // Seeded by the vertex itself, so every vertex gets the same rays
+    // whichever thread bakes it.
+    uint64_t state = seed;
+    for (size_t c = 0; c < 3; ++c) state = mix(state, position[c]);
+    for (size_t c = 0; c < 3; ++c) state = mix(state, n[c]);
+
+    size_t visible = 0;
+    for (size_t i = 0; i < grid; ++i) {
+      for (size_t j = 0; j < grid; ++j) {
+        const float u1 = (i + getRandom(state)) / grid;
+        const float u2 = (j + getRandom(state)) / grid;
+        const float radius = std::sqrt(u1);
+        const float angle = (float)(2.0 * PI) * u2;
+        const float x = radius * std::cos(angle), y = radius * std::sin(angle);
+        const float z = std::sqrt(std::max(0.0f, 1.0f - u1));
+        const float direction[3] = {x * tangent[0] + y * bitangent[0] + z * n[0],
+                                    x * tangent[1] + y * bitangent[1] + z * n[1],
+                                    x * tangent[2] + y * bitangent[2] + z * n[2]};
+        if (!bvh.isOccluded(origin, direction, distance)) ++visible;
+      }
+    }
+    return (float)visible / (grid * grid);
+  }
+
+  // Orthonormal basis around the unit vector `n` without branching on its
+  // largest component (Duff et al. 2017).
+  static void getBasis(const float n[3], float tangent[3], float bitangent[3]) {
+    const float sign = std::copysign(1.0f, n[2]);
+    const float a = -1.0f / (sign + n[2]);
+    const float b = n[0] * n[1] * a;
+    tangent[0] = 1.0f + sign * n[0] * n[0] * a;
+    tangent[1] = sign * b;
+    tangent[2] = -sign * n[0];
+    bitangent[0] = b;
+    bitangent[1] = sign + n[1] * n[1] * a;
+    bitangent[2] = -n[1];
+  }
+
+  template <typename T>
+  static uint64_t mix(uint64_t state, T value) {
+    // +0.0 and -0.0 are the same vertex.
+    const double number = value == 0 ? 0.0 : (double)value;
+    uint64_t bits;
+    std::memcpy(&bits, &number, sizeof(bits));
+    return splitMix(state ^ bits);
+  }
+
+  static uint64_t splitMix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+
+  // Uniform in [0, 1).
+  static float getRandom(uint64_t& state) {
+    state = splitMix(state);
+    return (float)(state >> 40) * (1.0f / 16777216.0f);
+  }
+};
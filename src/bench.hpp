@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#define BENCH_DEFAULT_FRAMES 600
+#define BENCH_WARMUP_FRAMES 30
+
+// Collects per-frame timings for the scripted `--bench` mode and prints
+// percentiles once the requested amount of frames has been rendered.
+class FrameBenchmark {
+ public:
+  typedef std::chrono::steady_clock clock_t;
+
+  bool enabled = false;
+  size_t totalFrames = BENCH_DEFAULT_FRAMES;
+  size_t warmupFrames = BENCH_WARMUP_FRAMES;
+
+  void beginFrame() { frameStart = clock_t::now(); }
+
+  void endFrame() {
+    const double ms = std::chrono::duration<double, std::milli>(
+                          clock_t::now() - frameStart)
+                          .count();
+    if (currentFrame >= warmupFrames) {
+      frameTimes.push_back(ms);
+    }
+    ++currentFrame;
+  }
+
+  size_t frame() const { return currentFrame; }
+  bool finished() const { return currentFrame >= warmupFrames + totalFrames; }
+
+  void report(std::ostream& out) const {
+    if (frameTimes.empty()) {
+      out << "bench: no frames recorded" << std::endl;
+      return;
+    }
+
+    std::vector<double> sorted = frameTimes;
+    std::sort(sorted.begin(), sorted.end());
+
+    double total = 0;
+    for (double ms : sorted) total += ms;
+
+    out << "bench: frames " << sorted.size() << " (warmup "
+        << warmupFrames << ")" << std::endl;
+    out << "bench: mean " << (total / sorted.size()) << " ms, fps "
+        << (1000.0 * sorted.size() / total) << std::endl;
+    out << "bench: min " << sorted.front() << " ms, p50 "
+        << percentile(sorted, 0.50) << " ms, p90 "
+        << percentile(sorted, 0.90) << " ms, p99 "
+        << percentile(sorted, 0.99) << " ms, max " << sorted.back()
+        << " ms" << std::endl;
+  }
+
+ private:
+  clock_t::time_point frameStart;
+  size_t currentFrame = 0;
+  std::vector<double> frameTimes;
+
+  static double percentile(const std::vector<double>& sorted, double p) {
+    const size_t idx = std::min(sorted.size() - 1,
+                                (size_t)(p * (sorted.size() - 1) + 0.5));
+    return sorted[idx];
+  }
+};
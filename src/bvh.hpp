@@ -0,0 +1,247 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "memory_tracker.hpp"
+#include "models.hpp"
+
+#define BVH_MAX_LEAF_FACES 4
+// Deeper nodes become leaves, bounds the traversal stack.
+#define BVH_MAX_DEPTH 64
+// Split candidates per axis when building.
+#define BVH_BINS 16
+
+// Triangle as its first vertex and two edges, ready for intersection.
+typedef struct {
+  float v0[3];
+  float e1[3];
+  float e2[3];
+} bvhTriangle_t;
+
+typedef struct {
+  float lo[3];
+  float hi[3];
+  // Leaves hold `count` triangles from `first`, inner nodes have count 0,
+  // their left child right after them and the right one at `first`.
+  uint32_t first;
+  uint32_t count;
+  uint32_t axis;
+} bvhNode_t;
+
+// Bounding volume hierarchy over the faces of a mesh, built with binned SAH
+// in single precision, answering "does this ray hit anything" queries.
+class TriangleBvh {
+ public:
+  explicit TriangleBvh(const faceList_t& faces) {
+    const size_t count = faces.size();
+    trackedVector<bvhTriangle_t, MEMORY_LOADER> source(count);
+    trackedVector<float, MEMORY_LOADER> centroids(count * 3);
+    for (size_t i = 0; i < count; ++i) {
+      const ObjectFace3D& face = faces[i];
+      for (size_t c = 0; c < 3; ++c) {
+        source[i].v0[c] = (float)face.p0[c];
+        source[i].e1[c] = (float)(face.p1[c] - face.p0[c]);
+        source[i].e2[c] = (float)(face.p2[c] - face.p0[c]);
+        centroids[i * 3 + c] = (float)((face.p0[c] + face.p1[c] + face.p2[c]) / 3.0);
+      }
+    }
+    trackedVector<uint32_t, MEMORY_LOADER> order(count);
+    for (uint32_t i = 0; i < count; ++i) order[i] = i;
+
+    nodes.reserve(count * 2);
+    if (count > 0) build(source, centroids, order, 0, (uint32_t)count, 0);
+    triangles.resize(count);
+    for (size_t i = 0; i < count; ++i) triangles[i] = source[order[i]];
+  }
+
+  size_t getNodeCount() const { return nodes.size(); }
+
+  // True when something is hit within (0, maxDistance) along `direction`,
+  // faces count from both sides.
+  bool isOccluded(const float origin[3], const float direction[3], float maxDistance) const {
+    if (nodes.empty()) return false;
+    float inverse[3];
+    for (size_t c = 0; c < 3; ++c) {
+      inverse[c] = direction[c] != 0 ? 1.0f / direction[c] : INFINITY;
+    }
+
+    uint32_t stack[BVH_MAX_DEPTH];
+    size_t depth = 0;
+    uint32_t index = 0;
+    for (;;) {
+      const bvhNode_t& node = nodes[index];
+      if (hitsBox(node, origin, inverse, maxDistance)) {
+        if (node.count > 0) {
+          for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+            if (hitsTriangle(triangles[i], origin, direction, maxDistance)) return true;
+          }
+        } else {
+          // Nearest child first, any hit ends the query.
+          const bool reversed = direction[node.axis] < 0;
+          stack[depth++] = reversed ? index + 1 : node.first;
+          index = reversed ? node.first : index + 1;
+          continue;
+        }
+      }
+      if (depth == 0) return false;
+      index = stack[--depth];
+    }
+  }
+
+ private:
+  trackedVector<bvhNode_t, MEMORY_LOADER> nodes;
+  trackedVector<bvhTriangle_t, MEMORY_LOADER> triangles;
+
+  static float getSurface(const float lo[3], const float hi[3]) {
+    const float x = hi[0] - lo[0], y = hi[1] - lo[1], z = hi[2] - lo[2];
+    return x * y + y * z + z * x;
+  }
+
+  static void grow(float lo[3], float hi[3], const bvhTriangle_t& triangle) {
+    for (size_t c = 0; c < 3; ++c) {
+      const float a = triangle.v0[c], b = a + triangle.e1[c], d = a + triangle.e2[c];
+      lo[c] = std::min(lo[c], std::min(a, std::min(b, d)));
+      hi[c] = std::max(hi[c], std::max(a, std::max(b, d)));
+    }
+  }
+
+  // Builds the node of `order[begin, end)` and its children, returns its index.
+  uint32_t build(const trackedVector<bvhTriangle_t, MEMORY_LOADER>& source,
+                 const trackedVector<float, MEMORY_LOADER>& centroids,
+                 trackedVector<uint32_t, MEMORY_LOADER>& order, uint32_t begin, uint32_t end, size_t depth) {
+    const uint32_t index = (uint32_t)nodes.size();
+    nodes.push_back(bvhNode_t());
+    bvhNode_t node = {{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}, begin, 0, 0};
+    float centerLo[3] = {INFINITY, INFINITY, INFINITY};
+    float centerHi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (uint32_t i = begin; i < end; ++i) {
+      grow(node.lo, node.hi, source[order[i]]);
+      for (size_t c = 0; c < 3; ++c) {
+        centerLo[c] = std::min(centerLo[c], centroids[order[i] * 3 + c]);
+        centerHi[c] = std::max(centerHi[c], centroids[order[i] * 3 + c]);
+      }
+    }
+
+    const uint32_t count = end - begin;
+    uint32_t middle = begin;
+    if (count > BVH_MAX_LEAF_FACES && depth + 1 < BVH_MAX_DEPTH) {
+      middle = split(source, centroids, order, begin, end, centerLo, centerHi, node);
+    }
+    if (middle == begin || middle == end) {
+      node.count = count;
+      nodes[index] = node;
+      return index;
+    }
+
+    build(source, centroids, order, begin, middle, depth + 1);
+    node.first = build(source, centroids, order, middle, end, depth + 1);
+    nodes[index] = node;
+    return index;
+  }
+
+  // Partitions `order[begin, end)` at the cheapest binned SAH plane and
+  // returns the first index of the right side, or `begin` when a leaf is
+  // cheaper.
+  static uint32_t split(const trackedVector<bvhTriangle_t, MEMORY_LOADER>& source,
+                        const trackedVector<float, MEMORY_LOADER>& centroids,
+                        trackedVector<uint32_t, MEMORY_LOADER>& order, uint32_t begin, uint32_t end,
+                        const float centerLo[3], const float centerHi[3], bvhNode_t& node) {
+    float bestCost = getSurface(node.lo, node.hi) * (end - begin);
+    int bestAxis = -1;
+    size_t bestBin = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+      const float extent = centerHi[axis] - centerLo[axis];
+      if (extent <= 0) continue;
+      size_t counts[BVH_BINS] = {};
+      float lo[BVH_BINS][3], hi[BVH_BINS][3];
+      for (size_t b = 0; b < BVH_BINS; ++b) {
+        std::fill(lo[b], lo[b] + 3, INFINITY);
+        std::fill(hi[b], hi[b] + 3, -INFINITY);
+      }
+      for (uint32_t i = begin; i < end; ++i) {
+        const size_t b = getBin(centroids[order[i] * 3 + axis], centerLo[axis], extent);
+        counts[b]++;
+        grow(lo[b], hi[b], source[order[i]]);
+      }
+
+      // Cost of the left side of every plane, then sweep from the right.
+      float leftCost[BVH_BINS];
+      float accLo[3] = {INFINITY, INFINITY, INFINITY}, accHi[3] = {-INFINITY, -INFINITY, -INFINITY};
+      size_t accCount = 0;
+      for (size_t b = 0; b + 1 < BVH_BINS; ++b) {
+        accCount += counts[b];
+        for (size_t c = 0; c < 3; ++c) {
+          accLo[c] = std::min(accLo[c], lo[b][c]);
+          accHi[c] = std::max(accHi[c], hi[b][c]);
+        }
+        leftCost[b] = accCount > 0 ? getSurface(accLo, accHi) * accCount : 0;
+      }
+      std::fill(accLo, accLo + 3, INFINITY);
+      std::fill(accHi, accHi + 3, -INFINITY);
+      accCount = 0;
+      for (size_t b = BVH_BINS - 1; b > 0; --b) {
+        accCount += counts[b];
+        for (size_t c = 0; c < 3; ++c) {
+          accLo[c] = std::min(accLo[c], lo[b][c]);
+          accHi[c] = std::max(accHi[c], hi[b][c]);
+        }
+        const float cost = leftCost[b - 1] + (accCount > 0 ? getSurface(accLo, accHi) * accCount : 0);
+        if (cost < bestCost) {
+          bestCost = cost;
+          bestAxis = axis;
+          bestBin = b;
+        }
+      }
+    }
+
+    if (bestAxis < 0) return begin;
+    const float extent = centerHi[bestAxis] - centerLo[bestAxis];
+    node.axis = (uint32_t)bestAxis;
+    return (uint32_t)(std::partition(order.begin() + begin, order.begin() + end,
+                                     [&](uint32_t i) {
+                                       return getBin(centroids[i * 3 + bestAxis], centerLo[bestAxis], extent) <
+                                              bestBin;
+                                     }) -
+                      order.begin());
+  }
+
+  static size_t getBin(float center, float lo, float extent) {
+    return std::min<size_t>(BVH_BINS - 1, (size_t)((center - lo) / extent * BVH_BINS));
+  }
+
+  static bool hitsBox(const bvhNode_t& node, const float origin[3], const float inverse[3], float maxDistance) {
+    float entry = 0, exit = maxDistance;
+    for (size_t c = 0; c < 3; ++c) {
+      float t0 = (node.lo[c] - origin[c]) * inverse[c];
+      float t1 = (node.hi[c] - origin[c]) * inverse[c];
+      if (t0 > t1) std::swap(t0, t1);
+      // NaN from 0 * inf (origin on a slab plane) keeps the other bound.
+      entry = t0 > entry ? t0 : entry;
+      exit = t1 < exit ? t1 : exit;
+    }
+    return entry <= exit;
+  }
+
+  // Möller-Trumbore.
+  static bool hitsTriangle(const bvhTriangle_t& tri, const float origin[3], const float direction[3],
+                           float maxDistance) {
+    const float p[3] = {direction[1] * tri.e2[2] - direction[2] * tri.e2[1],
+                        direction[2] * tri.e2[0] - direction[0] * tri.e2[2],
+                        direction[0] * tri.e2[1] - direction[1] * tri.e2[0]};
+    const float det = tri.e1[0] * p[0] + tri.e1[1] * p[1] + tri.e1[2] * p[2];
+    if (std::fabs(det) < 1e-12f) return false;
+    const float inverseDet = 1.0f / det;
+    const float s[3] = {origin[0] - tri.v0[0], origin[1] - tri.v0[1], origin[2] - tri.v0[2]};
+    const float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inverseDet;
+    if (u < 0 || u > 1) return false;
+    const float q[3] = {s[1] * tri.e1[2] - s[2] * tri.e1[1], s[2] * tri.e1[0] - s[0] * tri.e1[2],
+                        s[0] * tri.e1[1] - s[1] * tri.e1[0]};
+    const float v = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * inverseDet;
+    if (v < 0 || u + v > 1) return false;
+    const float t = (tri.e2[0] * q[0] + tri.e2[1] * q[1] + tri.e2[2] * q[2]) * inverseDet;
+    return t > 0 && t < maxDistance;
+  }
+};
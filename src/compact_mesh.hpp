@@ -0,0 +1,323 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define COMPACT_MESH_SSE2 1
+#else
+#define COMPACT_MESH_SSE2 0
+#endif
+
+#include "colors.hpp"
+#include "geom.hpp"
+#include "indexed_mesh.hpp"
+#include "models.hpp"
+
+#define COMPACT_POSITION_RANGE 32767.0
+#define COMPACT_NORMAL_RANGE 32767.0
+#define COMPACT_UV_RANGE 65535.0
+// UVs are 16 bit unorm stored with a -32768 bias, so GL can read them as
+// GL_SHORT and the texture matrix removes the bias.
+#define COMPACT_UV_BIAS 32768.0
+#define COMPACT_OCCLUSION_RANGE 32767.0
+
+// 16 bytes per vertex against the 72 bytes of doubles an `ObjectFace3D`
+// corner uses for position, uv and normal.
+typedef struct {
+  // Quantized against the mesh bounding box, w holds the baked ambient
+  // visibility as unorm.
+  int16_t position[4];
+  int16_t uv[2];
+  // Octahedral encoded unit vector.
+  int16_t normal[2];
+} compactVertex_t;
+
+// Resident mesh using `compactVertex_t` and an index buffer instead of the
+// per face doubles of `ObjectFace3D`. Lighting results live in the model,
+// per vertex (smooth) and per face (flat).
+class CompactMesh {
+ public:
+  typedef struct {
+    double maxPositionError;
+    double rmsPositionError;
+    double maxUvError;
+    // Degrees.
+    double maxNormalError;
+  } encodeError_t;
+
+  trackedVector<compactVertex_t, MEMORY_MESHES> vertices;
+  trackedVector<uint32_t, MEMORY_MESHES> indices;
+
+  // Unique vertices of every meshlet, so smooth lighting can skip the culled
+  // ones. Meshlet N uses `meshletVertices[meshletVertexOffsets[N]]` up to
+  // the next offset.
+  std::vector<uint32_t> meshletVertexOffsets;
+  std::vector<uint32_t> meshletVertices;
+
+  dVector3D positionCenter = dVector3D(0, 0, 0);
+  dVector3D positionHalfExtent = dVector3D(1, 1, 1);
+  dVector3D uvMin = dVector3D(0, 0, 0);
+  dVector3D uvExtent = dVector3D(1, 1, 0);
+
+  size_t getVertexCount() const { return vertices.size(); }
+  size_t getTriangleCount() const { return indices.size() / 3; }
+
+  size_t getResidentBytes() const {
+    return vertices.capacity() * sizeof(compactVertex_t) + indices.capacity() * sizeof(uint32_t) +
+           (meshletVertexOffsets.capacity() + meshletVertices.capacity()) * sizeof(uint32_t);
+  }
+
+  void buildMeshletVertices(const std::vector<meshlet_t>& meshlets) {
+    std::vector<uint32_t> seen(vertices.size(), UINT32_MAX);
+    meshletVertexOffsets.clear();
+    meshletVertices.clear();
+    for (uint32_t i = 0; i < meshlets.size(); ++i) {
+      meshletVertexOffsets.push_back((uint32_t)meshletVertices.size());
+      const size_t end = (meshlets[i].firstFace + meshlets[i].faceCount) * 3;
+      for (size_t k = meshlets[i].firstFace * 3; k < end; ++k) {
+        if (seen[indices[k]] == i) continue;
+        seen[indices[k]] = i;
+        meshletVertices.push_back(indices[k]);
+      }
+    }
+    meshletVertexOffsets.push_back((uint32_t)meshletVertices.size());
+  }
+
+  static CompactMesh encode(const faceList_t& faces, encodeError_t* error = nullptr) {
+    const IndexedMesh mesh = IndexedMesh::fromFaces(faces);
+    CompactMesh result;
+    result.indices.assign(mesh.indices.begin(), mesh.indices.end());
+    if (mesh.getVertexCount() == 0) return result;
+
+    dVector3D lo = mesh.positions[0], hi = mesh.positions[0];
+    dVector3D uvLo = mesh.uvs[0], uvHi = mesh.uvs[0];
+    for (size_t i = 0; i < mesh.getVertexCount(); ++i) {
+      for (size_t c = 0; c < 3; ++c) {
+        lo[c] = std::min(lo[c], mesh.positions[i][c]);
+        hi[c] = std::max(hi[c], mesh.positions[i][c]);
+        uvLo[c] = std::min(uvLo[c], mesh.uvs[i][c]);
+        uvHi[c] = std::max(uvHi[c], mesh.uvs[i][c]);
+      }
+    }
+    result.positionCenter = (lo + hi) * 0.5;
+    result.uvMin = uvLo;
+    for (size_t c = 0; c < 3; ++c) {
+      const double half = (hi[c] - lo[c]) * 0.5;
+      result.positionHalfExtent[c] = half > 0 ? half : 1.0;
+      const double extent = uvHi[c] - uvLo[c];
+      result.uvExtent[c] = extent > 0 ? extent : 1.0;
+    }
+
+    result.vertices.resize(mesh.getVertexCount());
+    for (size_t i = 0; i < mesh.getVertexCount(); ++i) {
+      compactVertex_t& v = result.vertices[i];
+      for (size_t c = 0; c < 3; ++c) {
+        v.position[c] = quantizeSnorm(
+            (mesh.positions[i][c] - result.positionCenter[c]) / result.positionHalfExtent[c],
+            COMPACT_POSITION_RANGE);
+      }
+      v.position[3] = (int16_t)std::lround(std::min(std::max((double)mesh.occlusion[i], 0.0), 1.0) *
+                                           COMPACT_OCCLUSION_RANGE);
+      for (size_t c = 0; c < 2; ++c) {
+        const double unorm = (mesh.uvs[i][c] - result.uvMin[c]) / result.uvExtent[c];
+        v.uv[c] = (int16_t)(std::lround(std::min(std::max(unorm, 0.0), 1.0) * COMPACT_UV_RANGE) -
+                            (long)COMPACT_UV_BIAS);
+      }
+      encodeOctahedral(mesh.normals[i], v.normal);
+    }
+
+    if (error != nullptr) *error = result.measureError(mesh);
+    return result;
+  }
+
+  dVector3D decodePosition(size_t idx) const {
+    const compactVertex_t& v = vertices[idx];
+    return dVector3D(positionCenter.x() + v.position[0] * positionHalfExtent.x() / COMPACT_POSITION_RANGE,
+                     positionCenter.y() + v.position[1] * positionHalfExtent.y() / COMPACT_POSITION_RANGE,
+                     positionCenter.z() + v.position[2] * positionHalfExtent.z() / COMPACT_POSITION_RANGE);
+  }
+
+  dVector3D decodeUv(size_t idx) const {
+    const compactVertex_t& v = vertices[idx];
+    return dVector3D(uvMin.x() + (v.uv[0] + COMPACT_UV_BIAS) * uvExtent.x() / COMPACT_UV_RANGE,
+                     uvMin.y() + (v.uv[1] + COMPACT_UV_BIAS) * uvExtent.y() / COMPACT_UV_RANGE, 0);
+  }
+
+  float decodeOcclusion(size_t idx) const {
+    return (float)(vertices[idx].position[3] / COMPACT_OCCLUSION_RANGE);
+  }
+
+  dVector3D decodeNormal(size_t idx) const {
+    float xyz[3];
+    decodeOctahedral(vertices[idx].normal, xyz);
+    return dVector3D(xyz[0], xyz[1], xyz[2]);
+  }
+
+  // Replaces the faces of `model` and its LODs with compact meshes, printing
+  // the memory saved and the quantization error of the full resolution mesh.
+  static void compactModel(Object3D& model) {
+    const size_t sourceFaces = model.faces.size();
+    size_t sourceBytes = model.faces.capacity() * sizeof(ObjectFace3D);
+    for (const faceList_t& lod : model.lods) {
+      sourceBytes += lod.capacity() * sizeof(ObjectFace3D);
+    }
+
+    encodeError_t error;
+    model.compactLods.clear();
+    model.compactLods.push_back(std::make_shared<CompactMesh>(encode(model.faces, &error)));
+    for (const faceList_t& lod : model.lods) {
+      model.compactLods.push_back(std::make_shared<CompactMesh>(encode(lod)));
+    }
+    for (size_t lod = 0; lod < model.meshlets.size() && lod < model.compactLods.size(); ++lod) {
+      model.compactLods[lod]->buildMeshletVertices(model.meshlets[lod]);
+    }
+    faceList_t().swap(model.faces);
+    std::vector<faceList_t>().swap(model.lods);
+
+    size_t compactBytes = 0;
+    for (const std::shared_ptr<CompactMesh>& mesh : model.compactLods) {
+      compactBytes += mesh->getResidentBytes();
+    }
+    std::cout << "Compact mesh: " << sourceFaces << " faces, " << model.compactLods[0]->getVertexCount()
+              << " vertices, " << sourceBytes << " -> " << compactBytes << " bytes ("
+              << ((double)sourceBytes / std::max<size_t>(compactBytes, 1)) << "x)" << std::endl;
+    std::cout << "Compact mesh error: position max " << error.maxPositionError << " rms "
+              << error.rmsPositionError << ", uv max " << error.maxUvError << ", normal max "
+              << error.maxNormalError << " deg" << std::endl;
+  }
+
+  // Decodes every position into `out` as packed xyz floats.
+  void decodePositions(std::vector<float>& out) const {
+    out.resize(vertices.size() * 3);
+    decodePositions(nullptr, vertices.size(), out.data());
+  }
+
+  // Decodes the positions of vertices `ids[0, count)` into their place of
+  // `out`, which holds packed xyz floats for every vertex.
+  void decodePositions(const uint32_t* ids, size_t count, float* out) const {
+    const float scale[3] = {(float)(positionHalfExtent.x() / COMPACT_POSITION_RANGE),
+                            (float)(positionHalfExtent.y() / COMPACT_POSITION_RANGE),
+                            (float)(positionHalfExtent.z() / COMPACT_POSITION_RANGE)};
+    const float offset[3] = {(float)positionCenter.x(), (float)positionCenter.y(),
+                             (float)positionCenter.z()};
+    for (size_t i = 0; i < count; ++i) {
+      const uint32_t v = ids != nullptr ? ids[i] : (uint32_t)i;
+      for (size_t c = 0; c < 3; ++c) {
+        out[v * 3 + c] = offset[c] + vertices[v].position[c] * scale[c];
+      }
+    }
+  }
+
+  // Decodes every normal into `out` as packed xyz floats.
+  void decodeNormals(std::vector<float>& out) const {
+    out.resize(vertices.size() * 3);
+    decodeNormals(nullptr, vertices.size(), out.data());
+  }
+
+  // Decodes the normals of vertices `ids[0, count)` into their place of
+  // `out`, four at a time when SSE2 is available.
+  void decodeNormals(const uint32_t* ids, size_t count, float* out) const {
+    size_t i = 0;
+#if COMPACT_MESH_SSE2
+    const __m128 inv = _mm_set1_ps((float)(1.0 / COMPACT_NORMAL_RANGE));
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    for (; i + 4 <= count; i += 4) {
+      uint32_t id[4];
+      for (size_t k = 0; k < 4; ++k) id[k] = ids != nullptr ? ids[i + k] : (uint32_t)(i + k);
+      const compactVertex_t* v[4] = {&vertices[id[0]], &vertices[id[1]], &vertices[id[2]], &vertices[id[3]]};
+      __m128 x = _mm_mul_ps(_mm_setr_ps(v[0]->normal[0], v[1]->normal[0], v[2]->normal[0], v[3]->normal[0]), inv);
+      __m128 y = _mm_mul_ps(_mm_setr_ps(v[0]->normal[1], v[1]->normal[1], v[2]->normal[1], v[3]->normal[1]), inv);
+      const __m128 z = _mm_sub_ps(_mm_sub_ps(one, _mm_andnot_ps(signMask, x)), _mm_andnot_ps(signMask, y));
+      // Fold the lower hemisphere: x -= sign(x) * max(-z, 0).
+      const __m128 t = _mm_max_ps(_mm_sub_ps(zero, z), zero);
+      x = _mm_sub_ps(x, _mm_or_ps(t, _mm_and_ps(signMask, x)));
+      y = _mm_sub_ps(y, _mm_or_ps(t, _mm_and_ps(signMask, y)));
+
+      const __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+      float xs[4], ys[4], zs[4];
+      _mm_storeu_ps(xs, _mm_div_ps(x, length));
+      _mm_storeu_ps(ys, _mm_div_ps(y, length));
+      _mm_storeu_ps(zs, _mm_div_ps(z, length));
+      for (size_t k = 0; k < 4; ++k) {
+        out[id[k] * 3] = xs[k];
+        out[id[k] * 3 + 1] = ys[k];
+        out[id[k] * 3 + 2] = zs[k];
+      }
+    }
+#endif
+    for (; i < count; ++i) {
+      const uint32_t v = ids != nullptr ? ids[i] : (uint32_t)i;
+      decodeOctahedral(vertices[v].normal, &out[v * 3]);
+    }
+  }
+
+ private:
+  static int16_t quantizeSnorm(double value, double range) {
+    return (int16_t)std::lround(std::min(std::max(value, -1.0), 1.0) * range);
+  }
+
+  static void encodeOctahedral(const dVector3D& normal, int16_t out[2]) {
+    const double l1 = std::fabs(normal.x()) + std::fabs(normal.y()) + std::fabs(normal.z());
+    if (l1 <= 0) {
+      out[0] = 0;
+      out[1] = 0;
+      return;
+    }
+    double x = normal.x() / l1;
+    double y = normal.y() / l1;
+    if (normal.z() < 0) {
+      const double ox = x;
+      x = (1.0 - std::fabs(y)) * (ox >= 0 ? 1.0 : -1.0);
+      y = (1.0 - std::fabs(ox)) * (y >= 0 ? 1.0 : -1.0);
+    }
+    out[0] = quantizeSnorm(x, COMPACT_NORMAL_RANGE);
+    out[1] = quantizeSnorm(y, COMPACT_NORMAL_RANGE);
+  }
+
+  static void decodeOctahedral(const int16_t in[2], float out[3]) {
+    float x = (float)(in[0] / COMPACT_NORMAL_RANGE);
+    float y = (float)(in[1] / COMPACT_NORMAL_RANGE);
+    const float z = 1.0f - std::fabs(x) - std::fabs(y);
+    const float t = std::max(-z, 0.0f);
+    x += x >= 0 ? -t : t;
+    y += y >= 0 ? -t : t;
+    const float length = std::sqrt(x * x + y * y + z * z);
+    out[0] = x / length;
+    out[1] = y / length;
+    out[2] = z / length;
+  }
+
+  encodeError_t measureError(const IndexedMesh& mesh) const {
+    encodeError_t error = {0, 0, 0, 0};
+    std::vector<float> normals;
+    decodeNormals(normals);
+
+    double squaredSum = 0;
+    for (size_t i = 0; i < vertices.size(); ++i) {
+      const double positionError = !(decodePosition(i) - mesh.positions[i]);
+      error.maxPositionError = std::max(error.maxPositionError, positionError);
+      squaredSum += positionError * positionError;
+
+      const dVector3D uv = decodeUv(i);
+      error.maxUvError = std::max(error.maxUvError, std::fabs(uv.x() - mesh.uvs[i].x()));
+      error.maxUvError = std::max(error.maxUvError, std::fabs(uv.y() - mesh.uvs[i].y()));
+
+      const double length = !mesh.normals[i];
+      if (length > 0) {
+        const dVector3D decoded(normals[i * 3], normals[i * 3 + 1], normals[i * 3 + 2]);
+        const double cosine = std::min(1.0, std::max(-1.0, (decoded % mesh.normals[i]) / length));
+        error.maxNormalError = std::max(error.maxNormalError, std::acos(cosine) * 180.0 / PI);
+      }
+    }
+    error.rmsPositionError = std::sqrt(squaredSum / vertices.size());
+    return error;
+  }
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cmath>
+
+#include "geom.hpp"
+
+// Column major 4x4 matrices, same layout as `glGetDoublev`.
+namespace mat4 {
+
+inline void multiply(const double a[16], const double b[16], double out[16]) {
+  double result[16];
+  for (int c = 0; c < 4; ++c) {
+    for (int r = 0; r < 4; ++r) {
+      result[c * 4 + r] = a[r] * b[c * 4] + a[4 + r] * b[c * 4 + 1] +
+                          a[8 + r] * b[c * 4 + 2] + a[12 + r] * b[c * 4 + 3];
+    }
+  }
+  for (int i = 0; i < 16; ++i) out[i] = result[i];
+}
+
+inline void transform(const double m[16], const double v[4], double out[4]) {
+  for (int r = 0; r < 4; ++r) {
+    out[r] = m[r] * v[0] + m[4 + r] * v[1] + m[8 + r] * v[2] + m[12 + r] * v[3];
+  }
+}
+
+// Returns false when `m` isn't invertible.
+inline bool invert(const double m[16], double out[16]) {
+  double inv[16];
+  inv[0] = m[5] * m[10] * m[15] - m[5] * m[11] * m[14] - m[9] * m[6] * m[15] + m[9] * m[7] * m[14] + m[13] * m[6] * m[11] - m[13] * m[7] * m[10];
+  inv[4] = -m[4] * m[10] * m[15] + m[4] * m[11] * m[14] + m[8] * m[6] * m[15] - m[8] * m[7] * m[14] - m[12] * m[6] * m[11] + m[12] * m[7] * m[10];
+  inv[8] = m[4] * m[9] * m[15] - m[4] * m[11] * m[13] - m[8] * m[5] * m[15] + m[8] * m[7] * m[13] + m[12] * m[5] * m[11] - m[12] * m[7] * m[9];
+  inv[12] = -m[4] * m[9] * m[14] + m[4] * m[10] * m[13] + m[8] * m[5] * m[14] - m[8] * m[6] * m[13] - m[12] * m[5] * m[10] + m[12] * m[6] * m[9];
+  inv[1] = -m[1] * m[10] * m[15] + m[1] * m[11] * m[14] + m[9] * m[2] * m[15] - m[9] * m[3] * m[14] - m[13] * m[2] * m[11] + m[13] * m[3] * m[10];
+  inv[5] = m[0] * m[10] * m[15] - m[0] * m[11] * m[14] - m[8] * m[2] * m[15] + m[8] * m[3] * m[14] + m[12] * m[2] * m[11] - m[12] * m[3] * m[10];
+  inv[9] = -m[0] * m[9] * m[15] + m[0] * m[11] * m[13] + m[8] * m[1] * m[15] - m[8] * m[3] * m[13] - m[12] * m[1] * m[11] + m[12] * m[3] * m[9];
+  inv[13] = m[0] * m[9] * m[14] - m[0] * m[10] * m[13] - m[8] * m[1] * m[14] + m[8] * m[2] * m[13] + m[12] * m[1] * m[10] - m[12] * m[2] * m[9];
+  inv[2] = m[1] * m[6] * m[15] - m[1] * m[7] * m[14] - m[5] * m[2] * m[15] + m[5] * m[3] * m[14] + m[13] * m[2] * m[7] - m[13] * m[3] * m[6];
+  inv[6] = -m[0] * m[6] * m[15] + m[0] * m[7] * m[14] + m[4] * m[2] * m[15] - m[4] * m[3] * m[14] - m[12] * m[2] * m[7] + m[12] * m[3] * m[6];
+  inv[10] = m[0] * m[5] * m[15] - m[0] * m[7] * m[13] - m[4] * m[1] * m[15] + m[4] * m[3] * m[13] + m[12] * m[1] * m[7] - m[12] * m[3] * m[5];
+  inv[14] = -m[0] * m[5] * m[14] + m[0] * m[6] * m[13] + m[4] * m[1] * m[14] - m[4] * m[2] * m[13] - m[12] * m[1] * m[6] + m[12] * m[2] * m[5];
+  inv[3] = -m[1] * m[6] * m[11] + m[1] * m[7] * m[10] + m[5] * m[2] * m[11] - m[5] * m[3] * m[10] - m[9] * m[2] * m[7] + m[9] * m[3] * m[6];
+  inv[7] = m[0] * m[6] * m[11] - m[0] * m[7] * m[10] - m[4] * m[2] * m[11] + m[4] * m[3] * m[10] + m[8] * m[2] * m[7] - m[8] * m[3] * m[6];
+  inv[11] = -m[0] * m[5] * m[11] + m[0] * m[7] * m[9] + m[4] * m[1] * m[11] - m[4] * m[3] * m[9] - m[8] * m[1] * m[7] + m[8] * m[3] * m[5];
+  inv[15] = m[0] * m[5] * m[10] - m[0] * m[6] * m[9] - m[4] * m[1] * m[10] + m[4] * m[2] * m[9] + m[8] * m[1] * m[6] - m[8] * m[2] * m[5];
+
+  const double det = m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12];
+  if (det == 0) return false;
+  for (int i = 0; i < 16; ++i) out[i] = inv[i] / det;
+  return true;
+}
+
+}  // namespace mat4
+
+// View volume and viewer expressed in the space of the matrix it was built
+// from, building it from projection * modelview * model gives object space
+// planes so bounds never have to be transformed.
+class ViewFrustum {
+ public:
+  // Left, right, bottom, top, near, far as (a, b, c, d) with the inside
+  // being positive.
+  double planes[6][4];
+  // Viewer position for perspective projections, for orthographic ones
+  // `viewer` is the direction pointing towards the viewer.
+  bool perspective = false;
+  dVector3D viewer = dVector3D(0, 0, 1);
+
+  ViewFrustum() {}
+
+  explicit ViewFrustum(const double clip[16]) {
+    for (int i = 0; i < 3; ++i) {
+      for (int c = 0; c < 4; ++c) {
+        const double w = clip[c * 4 + 3];
+        const double v = clip[c * 4 + i];
+        planes[i * 2][c] = w + v;
+        planes[i * 2 + 1][c] = w - v;
+      }
+    }
+
+    // The viewer maps to (0, 0, -1, 0) in clip space for both projections:
+    // the eye for perspective, the direction towards it for orthographic.
+    double inverse[16];
+    if (mat4::invert(clip, inverse)) {
+      const double towardsViewer[4] = {0, 0, -1, 0};
+      double v[4];
+      mat4::transform(inverse, towardsViewer, v);
+      perspective = std::fabs(v[3]) > 1e-12;
+      viewer = perspective ? dVector3D(v[0] / v[3], v[1] / v[3], v[2] / v[3])
+                           : dVector3D(~dVector3D(v[0], v[1], v[2]));
+    }
+  }
+
+  bool isSphereVisible(const dVector3D& center, double radius) const {
+    for (const double* p : planes) {
+      const double length = std::sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+      if (p[0] * center.x() + p[1] * center.y() + p[2] * center.z() + p[3] < -radius * length) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // True when every normal inside the cone faces away from the viewer for
+  // any point of the bounding sphere.
+  bool isConeBackfacing(const dVector3D& center, double radius, const dVector3D& axis, double cutoff) const {
+    if (cutoff >= 1.0) return false;
+    if (!perspective) return (axis % viewer) <= -cutoff;
+    const dVector3D toCenter = center - viewer;
+    return (toCenter % axis) >= cutoff * !toCenter + radius;
+  }
+};
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <stdexcept>
 #include <vector>
 
+#include "memory_tracker.hpp"
+
 typedef union PixelInfo {
   std::uint32_t Colour;
   struct {
@@ -12,18 +18,115 @@ typedef union PixelInfo {
 
 class Tga {
  private:
-  std::vector<std::uint8_t> Pixels;
+  trackedVector<std::uint8_t, MEMORY_TEXTURES> Pixels;
   bool ImageCompressed;
   std::uint32_t width, height, size, BitsPerPixel;
 
  public:
   Tga(const char* FilePath);
-  std::vector<std::uint8_t> GetPixels() { return this->Pixels; }
+  const trackedVector<std::uint8_t, MEMORY_TEXTURES>& GetPixels() const { return this->Pixels; }
+  // Moves the pixels out instead of copying them.
+  trackedVector<std::uint8_t, MEMORY_TEXTURES> TakePixels() { return std::move(this->Pixels); }
   std::uint32_t GetWidth() const { return this->width; }
   std::uint32_t GetHeight() const { return this->height; }
   bool HasAlphaChannel() { return BitsPerPixel == 32; }
+  // Reads the size and depth from the header only, without decoding pixels.
+  static void ReadHeader(const char* FilePath, std::uint32_t& Width, std::uint32_t& Height,
+                         std::uint32_t& BitsPerPixel);
+  // Writes RGB(A) `Pixels`, bottom row first, RLE encoded when `Compressed`.
+  static void Write(const char* FilePath, std::uint32_t Width, std::uint32_t Height,
+                    std::uint32_t BitsPerPixel, const std::uint8_t* Pixels, bool Compressed);
 };
 
+void Tga::Write(const char* FilePath, std::uint32_t Width, std::uint32_t Height,
+                std::uint32_t BitsPerPixel, const std::uint8_t* Pixels, bool Compressed) {
+  if ((BitsPerPixel != 24) && (BitsPerPixel != 32)) {
+    throw std::invalid_argument(
+        "Invalid File Format. Required: 24 or 32 Bit Image.");
+  }
+  std::fstream hFile(FilePath, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!hFile.is_open()) {
+    std::cout << "Can't write: " << FilePath << std::endl;
+    throw std::invalid_argument("File Not Writable.");
+  }
+
+  std::uint8_t Header[18] = {0};
+  Header[2] = Compressed ? 0xA : 0x2;
+  Header[12] = Width % 256;
+  Header[13] = Width / 256;
+  Header[14] = Height % 256;
+  Header[15] = Height / 256;
+  Header[16] = BitsPerPixel;
+  Header[17] = BitsPerPixel == 32 ? 8 : 0;
+  hFile.write(reinterpret_cast<const char*>(Header), sizeof(Header));
+
+  const std::size_t BytesPerPixel = BitsPerPixel / 8;
+  const std::size_t Count = (std::size_t)Width * Height;
+  auto WritePixel = [&](std::size_t Index) {
+    const std::uint8_t* P = Pixels + Index * BytesPerPixel;
+    const std::uint8_t Stored[4] = {P[2], P[1], P[0], BytesPerPixel > 3 ? P[3] : (std::uint8_t)0};
+    hFile.write(reinterpret_cast<const char*>(Stored), BytesPerPixel);
+  };
+  auto SamePixel = [&](std::size_t A, std::size_t B) {
+    return !std::memcmp(Pixels + A * BytesPerPixel, Pixels + B * BytesPerPixel, BytesPerPixel);
+  };
+
+  std::size_t CurrentPixel = 0;
+  while (CurrentPixel < Count) {
+    if (!Compressed) {
+      WritePixel(CurrentPixel++);
+      continue;
+    }
+    // Runs of 2 or more equal pixels, raw packets for everything else, up
+    // to 128 pixels per packet.
+    std::size_t Length = 1;
+    if (CurrentPixel + 1 < Count && SamePixel(CurrentPixel, CurrentPixel + 1)) {
+      while (Length < 128 && CurrentPixel + Length < Count && SamePixel(CurrentPixel, CurrentPixel + Length)) {
+        ++Length;
+      }
+      const std::uint8_t ChunkHeader = (std::uint8_t)(127 + Length);
+      hFile.write(reinterpret_cast<const char*>(&ChunkHeader), 1);
+      WritePixel(CurrentPixel);
+    } else {
+      while (Length < 128 && CurrentPixel + Length < Count &&
+             !(CurrentPixel + Length + 1 < Count && SamePixel(CurrentPixel + Length, CurrentPixel + Length + 1))) {
+        ++Length;
+      }
+      const std::uint8_t ChunkHeader = (std::uint8_t)(Length - 1);
+      hFile.write(reinterpret_cast<const char*>(&ChunkHeader), 1);
+      for (std::size_t I = 0; I < Length; ++I) WritePixel(CurrentPixel + I);
+    }
+    CurrentPixel += Length;
+  }
+  hFile.close();
+}
+
+void Tga::ReadHeader(const char* FilePath, std::uint32_t& Width, std::uint32_t& Height,
+                     std::uint32_t& BitsPerPixel) {
+  std::fstream hFile(FilePath, std::ios::in | std::ios::binary);
+  if (!hFile.is_open()) {
+    std::cout << "File not found: " << FilePath << std::endl;
+    throw std::invalid_argument("File Not Found.");
+  }
+
+  std::uint8_t Header[18] = {0};
+  hFile.read(reinterpret_cast<char*>(&Header), sizeof(Header));
+  hFile.close();
+  // Uncompressed (2) or RLE (10) true color images.
+  if (Header[2] != 0x2 && Header[2] != 0xA) {
+    throw std::invalid_argument(
+        "Invalid File Format. Required: 24 or 32 Bit TGA File.");
+  }
+
+  BitsPerPixel = Header[16];
+  Width = Header[13] * 256 + Header[12];
+  Height = Header[15] * 256 + Header[14];
+  if ((BitsPerPixel != 24) && (BitsPerPixel != 32)) {
+    throw std::invalid_argument(
+        "Invalid File Format. Required: 24 or 32 Bit Image.");
+  }
+}
+
 Tga::Tga(const char* FilePath) {
   std::fstream hFile(FilePath, std::ios::in | std::ios::binary);
   if (!hFile.is_open()) {
@@ -32,7 +135,7 @@ Tga::Tga(const char* FilePath) {
   }
 
   std::uint8_t Header[18] = {0};
-  std::vector<std::uint8_t> ImageData;
+  trackedVector<std::uint8_t, MEMORY_TEXTURES> ImageData;
   static std::uint8_t DeCompressed[12] = {0x0, 0x0, 0x2, 0x0, 0x0, 0x0,
                                           0x0, 0x0, 0x0, 0x0, 0x0, 0x0};
   static std::uint8_t IsCompressed[12] = {0x0, 0x0, 0xA, 0x0, 0x0, 0x0,
@@ -44,7 +147,8 @@ Tga::Tga(const char* FilePath) {
     BitsPerPixel = Header[16];
     width = Header[13] * 256 + Header[12];
     height = Header[15] * 256 + Header[14];
-    size = ((width * BitsPerPixel + 31) / 32) * 4 * height;
+    // Rows aren't padded.
+    size = width * height * (BitsPerPixel / 8);
 
     if ((BitsPerPixel != 24) && (BitsPerPixel != 32)) {
       hFile.close();
@@ -55,6 +159,14 @@ Tga::Tga(const char* FilePath) {
     ImageData.resize(size);
     ImageCompressed = false;
     hFile.read(reinterpret_cast<char*>(ImageData.data()), size);
+    if (hFile.fail()) {
+      std::cout << "Truncated image: " << FilePath << std::endl;
+      throw std::invalid_argument("Invalid File Format. Truncated Image Data.");
+    }
+    // Stored as BGR(A), returned as RGB(A) like compressed images.
+    for (std::size_t I = 0; I < size; I += BitsPerPixel / 8) {
+      std::swap(ImageData[I], ImageData[I + 2]);
+    }
   } else if (!std::memcmp(IsCompressed, &Header, sizeof(IsCompressed))) {
     BitsPerPixel = Header[16];
     width = Header[13] * 256 + Header[12];
@@ -68,19 +180,22 @@ Tga::Tga(const char* FilePath) {
     }
 
     PixelInfo Pixel = {0};
-    int CurrentByte = 0;
+    std::size_t CurrentByte = 0;
     std::size_t CurrentPixel = 0;
+    const std::size_t PixelCount = (std::size_t)width * height;
     ImageCompressed = true;
     std::uint8_t ChunkHeader = {0};
     int BytesPerPixel = (BitsPerPixel / 8);
-    ImageData.resize(width * height * sizeof(PixelInfo));
+    ImageData.resize(PixelCount * BytesPerPixel);
 
-    do {
+    while (CurrentPixel < PixelCount) {
       hFile.read(reinterpret_cast<char*>(&ChunkHeader), sizeof(ChunkHeader));
+      if (hFile.fail()) break;
 
+      // A packet running past the last pixel is cut short.
       if (ChunkHeader < 128) {
-        ++ChunkHeader;
-        for (int I = 0; I < ChunkHeader; ++I, ++CurrentPixel) {
+        const std::size_t Count = std::min<std::size_t>(ChunkHeader + 1, PixelCount - CurrentPixel);
+        for (std::size_t I = 0; I < Count; ++I, ++CurrentPixel) {
           hFile.read(reinterpret_cast<char*>(&Pixel), BytesPerPixel);
 
           ImageData[CurrentByte++] = Pixel.B;
@@ -89,17 +204,23 @@ Tga::Tga(const char* FilePath) {
           if (BitsPerPixel > 24) ImageData[CurrentByte++] = Pixel.A;
         }
       } else {
-        ChunkHeader -= 127;
+        const std::size_t Count = std::min<std::size_t>(ChunkHeader - 127, PixelCount - CurrentPixel);
         hFile.read(reinterpret_cast<char*>(&Pixel), BytesPerPixel);
 
-        for (int I = 0; I < ChunkHeader; ++I, ++CurrentPixel) {
+        for (std::size_t I = 0; I < Count; ++I, ++CurrentPixel) {
           ImageData[CurrentByte++] = Pixel.B;
           ImageData[CurrentByte++] = Pixel.G;
           ImageData[CurrentByte++] = Pixel.R;
           if (BitsPerPixel > 24) ImageData[CurrentByte++] = Pixel.A;
         }
       }
-    } while (CurrentPixel < (width * height));
+      if (hFile.fail()) break;
+    }
+    if (hFile.fail() || CurrentPixel < PixelCount) {
+      hFile.close();
+      std::cout << "Truncated image: " << FilePath << std::endl;
+      throw std::invalid_argument("Invalid File Format. Truncated Image Data.");
+    }
   } else {
     hFile.close();
     throw std::invalid_argument(
@@ -107,5 +228,5 @@ Tga::Tga(const char* FilePath) {
   }
 
   hFile.close();
-  this->Pixels = ImageData;
+  this->Pixels = std::move(ImageData);
 }
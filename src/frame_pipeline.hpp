@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+// Frames in flight, the one being drawn and the one being updated. Per frame
+// results (culling, lighting) are stored once per slot.
+#define FRAME_SLOTS 2
+// Busy waits before falling back to short sleeps, so an idle worker doesn't
+// burn a core between capped frames.
+#define FRAME_PIPELINE_SPINS 1024
+#define FRAME_PIPELINE_SLEEP_US 100
+
+// Runs the update of frame N + 1 (culling, lighting) on a worker thread while
+// the GL thread draws frame N. Frame N uses slot N % FRAME_SLOTS of every
+// double buffered result, the handoff is a pair of atomic counters and
+// nothing ever takes a lock.
+//
+// GL thread, every frame:
+//   submit(input for N + 1); slot = acquire(); draw(slot); release();
+template <typename Frame>
+class FramePipeline {
+ public:
+  typedef std::function<void(Frame& frame, size_t slot)> update_t;
+
+  ~FramePipeline() { stop(); }
+
+  // Without `threaded` updates run inside `submit` on the calling thread,
+  // with the same one frame latency, so both modes can be compared.
+  void start(update_t update, bool threaded) {
+    this->update = update;
+    this->threaded = threaded;
+    running = true;
+    if (threaded) worker = std::thread([this]() { run(); });
+  }
+
+  void stop() {
+    running = false;
+    if (worker.joinable()) worker.join();
+  }
+
+  // Queues the input of the next frame, waits if both slots are in flight.
+  void submit(const Frame& input) {
+    const size_t frame = submitted.load(std::memory_order_relaxed);
+    waitFor([&]() { return frame < drawn.load(std::memory_order_acquire) + FRAME_SLOTS; });
+    const size_t slot = frame % FRAME_SLOTS;
+    frames[slot] = input;
+    submitted.store(frame + 1, std::memory_order_release);
+    if (!threaded) {
+      update(frames[slot], slot);
+      published.store(frame + 1, std::memory_order_release);
+    }
+  }
+
+  // Waits for the oldest frame not drawn yet and returns its slot, nothing
+  // writes to it until `release`.
+  size_t acquire() {
+    const size_t frame = drawn.load(std::memory_order_relaxed);
+    waitFor([&]() { return published.load(std::memory_order_acquire) > frame; });
+    return frame % FRAME_SLOTS;
+  }
+
+  const Frame& get(size_t slot) const { return frames[slot]; }
+
+  void release() { drawn.store(drawn.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+ private:
+  Frame frames[FRAME_SLOTS];
+  update_t update;
+  bool threaded = false;
+  std::thread worker;
+  std::atomic<bool> running{false};
+  // Frames submitted by the GL thread, updated by the worker and drawn.
+  std::atomic<size_t> submitted{0};
+  std::atomic<size_t> published{0};
+  std::atomic<size_t> drawn{0};
+
+  // False when the pipeline was stopped while waiting.
+  template <typename Condition>
+  bool waitFor(Condition ready) const {
+    for (size_t spin = 0; !ready(); ++spin) {
+      if (!running.load(std::memory_order_relaxed)) return false;
+      if (spin < FRAME_PIPELINE_SPINS) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(FRAME_PIPELINE_SLEEP_US));
+      }
+    }
+    return true;
+  }
+
+  void run() {
+    for (size_t frame = 0; running.load(std::memory_order_relaxed); ++frame) {
+      if (!waitFor([&]() { return submitted.load(std::memory_order_acquire) > frame; })) return;
+      const size_t slot = frame % FRAME_SLOTS;
+      update(frames[slot], slot);
+      published.store(frame + 1, std::memory_order_release);
+    }
+  }
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "geom.hpp"
+#include "models.hpp"
+
+// Indexed view of the triangle soup stored in `Object3D`, corners with the
+// same position, uv and normal are welded into a single vertex.
+class IndexedMesh {
+ public:
+  std::vector<dVector3D> positions;
+  std::vector<dVector3D> uvs;
+  std::vector<dVector3D> normals;
+  // Baked ambient visibility, 1 when unoccluded.
+  std::vector<float> occlusion;
+  // Three entries per triangle.
+  std::vector<uint32_t> indices;
+
+  size_t getVertexCount() const { return positions.size(); }
+  size_t getTriangleCount() const { return indices.size() / 3; }
+
+  static IndexedMesh fromFaces(const faceList_t& faces) {
+    IndexedMesh mesh;
+    std::unordered_map<CornerKey, uint32_t, CornerKeyHash> lookup;
+    lookup.reserve(faces.size() * 2);
+    mesh.indices.reserve(faces.size() * 3);
+
+    // Corners welded together were baked alike, the first one's occlusion
+    // stands for all of them.
+    auto corner = [&](const dVector3D& p, const dVector3D& t, const dVector3D& n, float ao) -> uint32_t {
+      auto it = lookup.emplace(makeKey(p, t, n, false), (uint32_t)mesh.positions.size());
+      if (it.second) {
+        mesh.positions.push_back(p);
+        mesh.uvs.push_back(t);
+        mesh.normals.push_back(n);
+        mesh.occlusion.push_back(ao);
+      }
+      return it.first->second;
+    };
+
+    for (const ObjectFace3D& face : faces) {
+      mesh.indices.push_back(corner(face.p0, face.t0, face.p0n, face.ao0));
+      mesh.indices.push_back(corner(face.p1, face.t1, face.p1n, face.ao1));
+      mesh.indices.push_back(corner(face.p2, face.t2, face.p2n, face.ao2));
+    }
+    return mesh;
+  }
+
+  // For every vertex, the lowest vertex index sharing its exact position.
+  // Vertices split by uv seams or hard edges map to the same group.
+  std::vector<uint32_t> getPositionGroups() const {
+    std::unordered_map<CornerKey, uint32_t, CornerKeyHash> lookup;
+    lookup.reserve(positions.size());
+    std::vector<uint32_t> groups(positions.size());
+    for (uint32_t i = 0; i < positions.size(); ++i) {
+      groups[i] = lookup.emplace(makeKey(positions[i], uvs[i], normals[i], true), i).first->second;
+    }
+    return groups;
+  }
+
+ private:
+  struct CornerKey {
+    double values[9];
+
+    bool operator==(const CornerKey& other) const {
+      return std::memcmp(values, other.values, sizeof(values)) == 0;
+    }
+  };
+
+  struct CornerKeyHash {
+    size_t operator()(const CornerKey& key) const {
+      size_t h = 0;
+      for (double v : key.values) {
+        h ^= std::hash<double>()(v) + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+      }
+      return h;
+    }
+  };
+
+  static CornerKey makeKey(const dVector3D& p, const dVector3D& t, const dVector3D& n, bool positionOnly) {
+    CornerKey key = {{p.x(), p.y(), p.z(), 0, 0, 0, 0, 0, 0}};
+    if (!positionOnly) {
+      key.values[3] = t.x(); key.values[4] = t.y(); key.values[5] = t.z();
+      key.values[6] = n.x(); key.values[7] = n.y(); key.values[8] = n.z();
+    }
+    return key;
+  }
+};
@@ -1,9 +1,24 @@
 #include <GL/glut.h>
 
+#include <cctype>
+#include <cstdlib>
+#include <string>
+
+#include "ambient_occlusion.hpp"
+#include "bench.hpp"
+#include "compact_mesh.hpp"
+#include "frame_pipeline.hpp"
 #include "geom.hpp"
 #include "lights.hpp"
+#include "mesh_optimizer.hpp"
+#include "memory_report.hpp"
+#include "mesh_simplifier.hpp"
+#include "meshlets.hpp"
 #include "models.hpp"
+#include "occlusion.hpp"
 #include "scene.hpp"
+#include "scene_file.hpp"
+#include "texture_streamer.hpp"
 #include "wavefront_loader.hpp"
 
 #ifndef __RENDERER_VERSION__
@@ -28,6 +43,68 @@ static Scene globalScene;
 static eRenderMethod renderMethod = RENDER_TEXTURED;
 static bool rotate = false;
 static eLightingMode lightningModel = LIGHTNING_MODE_SMOOTH;
+static FrameBenchmark bench;
+static bool optimizeFaceOrder = false;
+static bool compactMeshes = false;
+static size_t instanceCount = 1;
+static std::string scenePath;
+static double creaseAngle = NORMALS_DEFAULT_CREASE_ANGLE;
+static eNormalWeighting normalWeighting = NORMALS_WEIGHT_ANGLE;
+// Ambient occlusion rays per vertex, 0 skips baking.
+static size_t aoSamples = 0;
+static uint64_t aoSeed = AO_DEFAULT_SEED;
+static bool meshletCulling = true;
+static eOcclusionMode occlusionMode = OCCLUSION_OFF;
+static OcclusionBuffer occlusion;
+static cullStats_t cullStats = {};
+static size_t cullFrames = 0;
+static bool pipelined = true;
+static bool memoryReport = false;
+static bool memoryReportRequested = false;
+static TextureStreamer textureStreamer;
+
+// Input of a frame update, captured on the GL thread, and the state its
+// results are drawn with.
+typedef struct {
+  GLdouble modelview[16];
+  GLdouble projection[16];
+  GLint viewport[4];
+  eLightingMode lightingMode;
+  bool meshletCulling;
+  eOcclusionMode occlusionMode;
+  // Printed by the update, which is the only thread resizing containers.
+  bool printMemory;
+  cullStats_t cullStats;
+} frame_t;
+
+// Declared after everything the update reads so it's destroyed, and its
+// worker joined, first.
+static FramePipeline<frame_t> pipeline;
+
+// Camera path of every bench step: the view zooms from BENCH_MAX_ZOOM out to
+// BENCH_MIN_ZOOM and back, so instances cross the LOD thresholds, while
+// panning up to BENCH_PAN across it so meshlets leave and enter the frustum.
+#define BENCH_MAX_ZOOM 2.0
+#define BENCH_MIN_ZOOM 0.125
+#define BENCH_PAN 0.6
+
+typedef struct {
+  eRenderMethod renderMethod;
+  eLightingMode lightingMode;
+  // Orbits once around the model during the step.
+  bool rotate;
+} benchStep_t;
+
+// Mode sequence replayed by `--bench`, every step gets an equal share of the
+// frames so runs with the same frame count are comparable.
+static const benchStep_t benchScript[] = {
+    {RENDER_TEXTURED, LIGHTNING_MODE_SMOOTH, true},
+    {RENDER_TEXTURED, LIGHTNING_MODE_FLAT, true},
+    {RENDER_TEXTURED, LIGHTNING_MODE_OFF, true},
+    {RENDER_GRAY_SCALE, LIGHTNING_MODE_SMOOTH, true},
+    {RENDER_GRAY_SCALE, LIGHTNING_MODE_FLAT, false},
+    {RENDER_WIREFRAME, LIGHTNING_MODE_OFF, false},
+};
 
 static void glut_post_redisplay_p(void) {
   static double t0 = -1.;
@@ -43,6 +120,120 @@ static void glut_post_redisplay_p(void) {
   glutPostRedisplay();
 }
 
+static void glut_post_redisplay_uncapped(void) { glutPostRedisplay(); }
+
+static void applyBenchScript(size_t frame) {
+  const size_t steps = sizeof(benchScript) / sizeof(benchScript[0]);
+  const size_t framesPerStep = std::max<size_t>(
+      2, (bench.warmupFrames + bench.totalFrames) / steps);
+  const size_t half = framesPerStep / 2;
+  const size_t stepFrame = frame % framesPerStep;
+  const benchStep_t& step = benchScript[std::min(steps - 1, frame / framesPerStep)];
+
+  renderMethod = step.renderMethod;
+  lightningModel = step.lightingMode;
+  rotate = false;
+
+  // The camera only depends on the frame, so every step starts from the
+  // same position and runs with the same frame count are comparable. Depth
+  // isn't zoomed in past the clip volume.
+  const double phase = (double)std::min(stepFrame, 2 * half) / (2 * half);
+  const double zoom =
+      std::exp2(std::log2(BENCH_MAX_ZOOM) +
+                (std::log2(BENCH_MIN_ZOOM) - std::log2(BENCH_MAX_ZOOM)) * std::sin(PI * phase));
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  glTranslated(BENCH_PAN * std::sin(2 * PI * phase), 0.5 * BENCH_PAN * std::sin(4 * PI * phase), 0);
+  glScaled(zoom, zoom, std::min(zoom, 1.0));
+  // Same initial orientation as main().
+  glRotated(180.0 + (step.rotate ? 360.0 * phase : 0.0), 0.0, 1.0, 0.0);
+}
+
+static void parseArguments(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--bench") {
+      bench.enabled = true;
+      if (i + 1 < argc && std::isdigit((unsigned char)argv[i + 1][0])) {
+        bench.totalFrames = std::strtoul(argv[++i], nullptr, 10);
+      }
+    } else if (arg == "--optimize-faces") {
+      optimizeFaceOrder = true;
+    } else if (arg == "--compact-meshes") {
+      compactMeshes = true;
+    } else if (arg == "--occlusion") {
+      occlusionMode = OCCLUSION_CONSERVATIVE;
+      if (i + 1 < argc && std::string(argv[i + 1]) == "aggressive") {
+        occlusionMode = OCCLUSION_AGGRESSIVE;
+        ++i;
+      } else if (i + 1 < argc && std::string(argv[i + 1]) == "conservative") {
+        ++i;
+      }
+    } else if (arg == "--memory") {
+      memoryReport = true;
+    } else if (arg == "--no-pipeline") {
+      pipelined = false;
+    } else if (arg == "--crease-angle" && i + 1 < argc) {
+      creaseAngle = std::strtod(argv[++i], nullptr);
+    } else if (arg == "--normal-weighting" && i + 1 < argc) {
+      const std::string weighting = argv[++i];
+      if (weighting == "area") {
+        normalWeighting = NORMALS_WEIGHT_AREA;
+      } else if (weighting == "angle") {
+        normalWeighting = NORMALS_WEIGHT_ANGLE;
+      } else {
+        std::cout << "Unknown normal weighting " << weighting << ", expected area or angle" << std::endl;
+        exit(1);
+      }
+    } else if (arg == "--bake-ao") {
+      aoSamples = AO_DEFAULT_SAMPLES;
+      if (i + 1 < argc && std::isdigit((unsigned char)argv[i + 1][0])) {
+        aoSamples = std::strtoul(argv[++i], nullptr, 10);
+      }
+    } else if (arg == "--ao-seed" && i + 1 < argc) {
+      aoSeed = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--scene" && i + 1 < argc) {
+      scenePath = argv[++i];
+    } else if (arg == "--texture-budget" && i + 1 < argc) {
+      textureStreamer.budgetBytes = std::strtoul(argv[++i], nullptr, 10) << 20;
+    } else if (arg == "--instances" && i + 1 < argc) {
+      instanceCount = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    }
+  }
+}
+
+static ColorRGB toGreyScale(const ColorRGB& color) {
+  const float lightning = (color.red + color.green + color.blue) / 3;
+  return ColorRGB(lightning, lightning, lightning);
+}
+
+static void applyInstanceTransform(const Instance3D& instance) {
+  GLdouble transform[16];
+  instance.getTransform(transform);
+  glMultMatrixd(transform);
+}
+
+// Face ranges of the meshlets `instance` sees in the frame of `slot`, or its
+// whole mesh when it has no meshlets.
+static const std::vector<faceRange_t>& getVisibleRanges(
+    const Instance3D& instance, size_t slot, size_t faceCount) {
+  // Used by both the update and the GL thread.
+  static thread_local std::vector<faceRange_t> ranges;
+  ranges.clear();
+  const Object3D& model = *instance.model;
+  const instanceFrame_t& frame = instance.frames[slot];
+  if (frame.lod >= model.meshlets.size()) {
+    ranges.push_back({0, (uint32_t)faceCount, UINT32_MAX});
+    return ranges;
+  }
+  const std::vector<meshlet_t>& meshlets = model.meshlets[frame.lod];
+  for (uint32_t i : frame.visibleMeshlets) {
+    ranges.push_back({meshlets[i].firstFace,
+                      meshlets[i].firstFace + meshlets[i].faceCount, i});
+  }
+  return ranges;
+}
+
 static void handleKeyboard(unsigned char key, int x, int y) {
   switch (key) {
     case 'w':
@@ -73,6 +264,26 @@ static void handleKeyboard(unsigned char key, int x, int y) {
       }
       std::cout << "RenderMethod: " << renderMethod << std::endl;
       break;
+    case 'v':
+      Meshlets::printStats(cullStats, cullFrames, std::cout);
+      cullStats = {};
+      cullFrames = 0;
+      meshletCulling = !meshletCulling;
+      std::cout << "MeshletCulling: " << meshletCulling << std::endl;
+      break;
+    case 'o':
+      Meshlets::printStats(cullStats, cullFrames, std::cout);
+      cullStats = {};
+      cullFrames = 0;
+      occlusionMode = (eOcclusionMode)((int)occlusionMode + 1);
+      if (occlusionMode >= OCCLUSION_END) {
+        occlusionMode = OCCLUSION_OFF;
+      }
+      std::cout << "OcclusionMode: " << occlusionMode << std::endl;
+      break;
+    case 'm':
+      memoryReportRequested = true;
+      break;
     case 'l':
       lightningModel = (eLightingMode)((int)lightningModel + 1);
       if (lightningModel >= LIGHTNING_END) {
@@ -84,16 +295,76 @@ static void handleKeyboard(unsigned char key, int x, int y) {
 }
 
 void loadTextures();
+void updateFrame(frame_t& frame, size_t slot);
+void selectLods(const frame_t& frame, size_t slot);
+void cullMeshlets(frame_t& frame, size_t slot);
+void cullOccluded(frame_t& frame, size_t slot,
+                  const double viewProjection[16]);
 void mainRenderLoop();
-void renderWireframe();
-void renderWithGreyScale();
-void renderWithTexture();
-void renderWithTexture();
+void renderWireframe(const frame_t& frame, size_t slot);
+void renderWithGreyScale(const frame_t& frame, size_t slot);
+void renderWithTexture(const frame_t& frame, size_t slot);
+void renderCompactModel(Object3D& model, const Instance3D& instance,
+                        const frame_t& frame, size_t slot);
+
+// Loads a model and builds everything drawn from it.
+static std::shared_ptr<Object3D> loadModel(const std::string& objPath,
+                                           const std::string& texturePath) {
+  MemoryStats::resetPeaks();
+  const size_t baseline = MemoryStats::getTotalCurrent();
+  std::shared_ptr<Object3D> model = std::make_shared<Object3D>(
+      WavefrontObjLoader::loadObjWavefrontObj(objPath, texturePath,
+                                              creaseAngle, normalWeighting));
+  MemoryStats::expectReleased(MEMORY_LOADER, "after loading");
+  MeshSimplifier::buildLodChain(*model);
+  if (aoSamples > 0) {
+    AmbientOcclusion::bakeModel(*model, aoSamples, aoSeed);
+    MemoryStats::expectReleased(MEMORY_LOADER, "after baking");
+  }
+  // Meshlets pick the face order first, the optimizer only reorders within
+  // each of them.
+  Meshlets::buildModel(*model);
+  if (optimizeFaceOrder) {
+    MeshOptimizer::optimizeModel(*model);
+  }
+  if (compactMeshes) {
+    CompactMesh::compactModel(*model);
+  }
+  model->loadPeakBytes = MemoryStats::getTotalPeak() - baseline;
+  return model;
+}
 
 void setupScene() {
-  globalScene.models = {WavefrontObjLoader::loadObjWavefrontObj(
-      "../wavefront_objs/head/model.obj",
-      "../wavefront_objs/head/texture.tga")};
+  std::vector<sceneEntry_t> entries;
+  if (scenePath.empty()) {
+    entries.push_back({"../wavefront_objs/head/model.obj",
+                       "../wavefront_objs/head/texture.tga", instanceCount});
+  } else {
+    entries = SceneFile::load(scenePath);
+  }
+  size_t total = 0;
+  for (const sceneEntry_t& entry : entries) total += entry.instances;
+
+  // Instances of every model are laid on one square grid scaled down to fit
+  // the view.
+  const size_t side = (size_t)std::ceil(std::sqrt((double)total));
+  const double scale = 1.0 / side;
+  size_t cell = 0;
+  for (const sceneEntry_t& entry : entries) {
+    std::shared_ptr<Object3D> model =
+        loadModel(entry.objPath, entry.texturePath);
+    for (size_t i = 0; i < entry.instances; ++i, ++cell) {
+      Instance3D& instance = globalScene.addInstance(model);
+      if (side > 1) {
+        instance.scale = scale;
+        instance.position =
+            dVector3D(-1.0 + scale * (2 * (cell % side) + 1),
+                      -1.0 + scale * (2 * (cell / side) + 1), 0) -
+            (model->boundsCenter * scale);
+      }
+    }
+  }
+  globalScene.sortInstances();
   globalScene.lights = {Light3D(255, 255, 255, ~dVector3D(1, 1, 1))};
 }
 
@@ -103,6 +374,7 @@ int main(int argc, char** argv) {
   glutInitWindowPosition(0, 0);
   glutInitWindowSize(800, 800);
   glutInitDisplayMode(GLUT_DEPTH | GLUT_RGBA | GLUT_DOUBLE);
+  parseArguments(argc, argv);
 
   if (glutCreateWindow("Testing") == GL_FALSE) {
     exit(1);
@@ -110,6 +382,10 @@ int main(int argc, char** argv) {
 
   setupScene();
   loadTextures();
+  if (memoryReport) {
+    MemoryReport::print(globalScene, std::cout);
+  }
+  pipeline.start(updateFrame, pipelined);
 
   glShadeModel(GL_SMOOTH);
   glFrontFace(GL_CCW);
@@ -119,7 +395,8 @@ int main(int argc, char** argv) {
   glRotated(180.0, 0.0, 1.0, 0.0);
 
   glutKeyboardFunc(handleKeyboard);
-  glutIdleFunc(glut_post_redisplay_p);
+  glutIdleFunc(bench.enabled ? glut_post_redisplay_uncapped
+                              : glut_post_redisplay_p);
   glutDisplayFunc(mainRenderLoop);
   glutMainLoop();
 
@@ -127,196 +404,590 @@ int main(int argc, char** argv) {
 }
 
 void loadTextures() {
-  for (Object3D& object : globalScene.models) {
-    GLuint texture = 0;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, object.texture.width,
-                 object.texture.height, 0, GL_RGB, GL_UNSIGNED_BYTE,
-                 *object.texture.data);
-
-    object.texture.textureRef = texture;
-    object.texture.data.reset();
+  for (const std::shared_ptr<Object3D>& model : globalScene.models) {
+    textureStreamer.add(model->texture);
   }
 }
 
 void mainRenderLoop() {
+  if (bench.enabled) {
+    bench.beginFrame();
+    applyBenchScript(bench.frame());
+  }
+
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
   if (rotate) {
     glRotatef(1.0, 0.0, 1.0, 0.0);
   }
 
-  switch (lightningModel) {
-    case LIGHTNING_MODE_FLAT:
-      globalScene.applyLightingToModels();
-      break;
-    case LIGHTNING_MODE_SMOOTH:
-      globalScene.applyLightningToModelsSmooth();
-    default:
-      break;
+  // The camera and modes of this frame are the input of the next update,
+  // which runs while the previous update is drawn. The first frame primes
+  // the pipeline with the same input twice.
+  frame_t input = {};
+  glGetDoublev(GL_MODELVIEW_MATRIX, input.modelview);
+  glGetDoublev(GL_PROJECTION_MATRIX, input.projection);
+  glGetIntegerv(GL_VIEWPORT, input.viewport);
+  input.lightingMode = lightningModel;
+  input.meshletCulling = meshletCulling;
+  input.occlusionMode = occlusionMode;
+  input.printMemory = memoryReportRequested;
+  memoryReportRequested = false;
+  static bool primed = false;
+  if (!primed) {
+    pipeline.submit(input);
+    primed = true;
   }
+  pipeline.submit(input);
+
+  const size_t slot = pipeline.acquire();
+  const frame_t& frame = pipeline.get(slot);
+  textureStreamer.update(slot);
+  // Drawn with the camera it was culled with.
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadMatrixd(frame.projection);
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadMatrixd(frame.modelview);
 
   switch (renderMethod) {
     case RENDER_WIREFRAME:
       glDisable(GL_TEXTURE_2D);
-      renderWireframe();
+      renderWireframe(frame, slot);
       break;
     case RENDER_GRAY_SCALE:
-      renderWithGreyScale();
+      renderWithGreyScale(frame, slot);
       break;
     case RENDER_TEXTURED:
       glEnable(GL_TEXTURE_2D);
-      renderWithTexture();
+      renderWithTexture(frame, slot);
       break;
     default:
       break;
   }
 
+  glPopMatrix();
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
+  Meshlets::accumulateStats(cullStats, frame.cullStats);
+  cullFrames++;
+  // After the report the update printed, streaming state lives on this
+  // thread.
+  if (frame.printMemory) {
+    textureStreamer.printStats(std::cout);
+  }
+  // GL has copied every client array by now, the slot can be updated again.
+  pipeline.release();
+
   glFlush();
   glutSwapBuffers();
+
+  if (bench.enabled) {
+    // Wait for the GL to drain so the frame time covers the whole frame and
+    // not only the command submission.
+    glFinish();
+    bench.endFrame();
+    if (bench.finished()) {
+      bench.report(std::cout);
+      Meshlets::printStats(cullStats, cullFrames, std::cout);
+      textureStreamer.printStats(std::cout);
+      if (memoryReport) {
+        pipeline.stop();
+        textureStreamer.stop();
+        MemoryReport::print(globalScene, std::cout);
+        MemoryStats::expectReleased(MEMORY_TEXTURES, "after streaming");
+      }
+      exit(0);
+    }
+  }
 }
 
-void renderWireframe() {
-  glColor3f(1, 1, 1);
-  for (Object3D& model : globalScene.models) {
-    for (ObjectFace3D& face : model.faces) {
-      glBegin(GL_LINES);
-      glVertex3f(face.p0.x(), face.p0.y(), face.p0.z());
-      glVertex3f(face.p1.x(), face.p1.y(), face.p1.z());
-      glEnd();
-      glBegin(GL_LINES);
-      glVertex3f(face.p1.x(), face.p1.y(), face.p1.z());
-      glVertex3f(face.p2.x(), face.p2.y(), face.p2.z());
-      glEnd();
-      glBegin(GL_LINES);
-      glVertex3f(face.p2.x(), face.p2.y(), face.p2.z());
-      glVertex3f(face.p0.x(), face.p0.y(), face.p0.z());
-      glEnd();
-
-      glColor3d(1, 1, 0);
-      glBegin(GL_LINES);
-      dVector3D f = (face.p0 + (face.p0n * 0.1));
-      glVertex3f(face.p0.x(), face.p0.y(), face.p0.z());
-      glVertex3f(f.x(), f.y(), f.z());
-      glEnd();
-      glBegin(GL_LINES);
-      f = (face.p1 + (face.p1n * 0.1));
-      glVertex3f(face.p1.x(), face.p1.y(), face.p1.z());
-      glVertex3f(f.x(), f.y(), f.z());
-      glEnd();
-      glBegin(GL_LINES);
-      f = (face.p2 + (face.p2n * 0.1));
-      glVertex3f(face.p2.x(), face.p2.y(), face.p2.z());
-      glVertex3f(f.x(), f.y(), f.z());
-      glEnd();
-      glColor3d(1, 1, 1);
-
-      glColor3d(0, 1, 1);
-      glBegin(GL_LINES);
-      dVector3D lightPos = globalScene.lights[0].position;
-      f = (face.p0 * 0.9f) + (lightPos * 0.1f);
-      glVertex3f(face.p0.x(), face.p0.y(), face.p0.z());
-      glVertex3f(f.x(), f.y(), f.z());
-      glEnd();
-      glBegin(GL_LINES);
-      f = (face.p1 * 0.9f) + (lightPos * 0.1f);
-      glVertex3f(face.p1.x(), face.p1.y(), face.p1.z());
-      glVertex3f(f.x(), f.y(), f.z());
-      glEnd();
-      glBegin(GL_LINES);
-      f = (face.p2 * 0.9f) + (lightPos * 0.1f);
-      glVertex3f(face.p2.x(), face.p2.y(), face.p2.z());
-      glVertex3f(f.x(), f.y(), f.z());
-      glEnd();
-      glColor3d(1, 1, 1);
+// Runs on the pipeline worker, or inside `FramePipeline::submit` with
+// `--no-pipeline`, so it must not make GL calls.
+void updateFrame(frame_t& frame, size_t slot) {
+  frame.cullStats = {};
+  selectLods(frame, slot);
+  cullMeshlets(frame, slot);
+  TextureStreamer::requestLevels(globalScene, slot);
+
+  switch (frame.lightingMode) {
+    case LIGHTNING_MODE_FLAT:
+      globalScene.applyLightingToModels(slot);
+      break;
+    case LIGHTNING_MODE_SMOOTH:
+      globalScene.applyLightningToModelsSmooth(slot);
+    default:
+      break;
+  }
+
+  if (frame.printMemory) {
+    MemoryReport::print(globalScene, std::cout);
+  }
+}
+
+void selectLods(const frame_t& frame, size_t slot) {
+  const GLdouble* modelview = frame.modelview;
+  const GLdouble* projection = frame.projection;
+  const GLint* viewport = frame.viewport;
+
+  // Largest axis scale of the modelview, so scaled models keep their size.
+  double scale = 0;
+  for (int c = 0; c < 3; ++c) {
+    scale = std::max(scale, !dVector3D(modelview[c * 4], modelview[c * 4 + 1],
+                                       modelview[c * 4 + 2]));
+  }
+
+  for (const std::shared_ptr<Object3D>& model : globalScene.models) {
+    model->usedLods = 0;
+  }
+
+  for (Instance3D& instance : globalScene.instances) {
+    const Object3D& model = *instance.model;
+    GLdouble transform[16];
+    instance.getTransform(transform);
+    const double local[4] = {model.boundsCenter.x(), model.boundsCenter.y(),
+                             model.boundsCenter.z(), 1};
+    double world[4];
+    mat4::transform(transform, local, world);
+    const dVector3D c(world[0], world[1], world[2]);
+    double eye[4];
+    for (int r = 0; r < 4; ++r) {
+      eye[r] = modelview[r] * c.x() + modelview[4 + r] * c.y() +
+               modelview[8 + r] * c.z() + modelview[12 + r];
+    }
+    double w = 0;
+    for (int r = 0; r < 4; ++r) w += projection[r * 4 + 3] * eye[r];
+
+    double diameter = LOD_FULL_DETAIL_PIXELS;
+    if (w > 1e-6) {
+      diameter = 2.0 * model.boundsRadius * instance.scale * scale *
+                 std::fabs(projection[5]) * (viewport[3] * 0.5) / w;
     }
+    instance.frames[slot].diameter = diameter;
+    instance.frames[slot].lod = MeshSimplifier::selectLod(model, diameter);
+    instance.model->usedLods |= 1u << instance.frames[slot].lod;
   }
 }
 
-void renderWithGreyScale() {
-  for (Object3D& model : globalScene.models) {
-    for (ObjectFace3D& face : model.faces) {
-      const dVector3D& p0 = face.p0;
-      const dVector3D& p1 = face.p1;
-      const dVector3D& p2 = face.p2;
-      double lightning0 =
-          (face.color0.red + face.color0.green + face.color0.blue) / 3;
-      double lightning1 =
-          (face.color1.red + face.color1.green + face.color1.blue) / 3;
-      double lightning2 =
-          (face.color2.red + face.color2.green + face.color2.blue) / 3;
-      if (lightningModel == LIGHTNING_MODE_OFF) {
-        lightning0 = 1;
-        lightning1 = 1;
-        lightning2 = 1;
+void cullMeshlets(frame_t& frame, size_t slot) {
+  GLdouble viewProjection[16];
+  mat4::multiply(frame.projection, frame.modelview, viewProjection);
+
+  for (const std::shared_ptr<Object3D>& model : globalScene.models) {
+    for (std::vector<uint8_t>& visible : model->meshletVisible) {
+      std::fill(visible.begin(), visible.end(), 0);
+    }
+  }
+
+  for (Instance3D& instance : globalScene.instances) {
+    Object3D& model = *instance.model;
+    instanceFrame_t& instanceFrame = instance.frames[slot];
+    instanceFrame.visibleMeshlets.clear();
+    if (instanceFrame.lod >= model.meshlets.size()) continue;
+    const std::vector<meshlet_t>& meshlets = model.meshlets[instanceFrame.lod];
+
+    if (frame.meshletCulling) {
+      // Culling happens in object space, planes and viewer come from the
+      // full object to clip matrix.
+      GLdouble transform[16], clip[16];
+      instance.getTransform(transform);
+      mat4::multiply(viewProjection, transform, clip);
+      Meshlets::cull(meshlets, ViewFrustum(clip), true,
+                     instanceFrame.visibleMeshlets, frame.cullStats);
+    } else {
+      for (uint32_t i = 0; i < meshlets.size(); ++i) {
+        instanceFrame.visibleMeshlets.push_back(i);
+        frame.cullStats.faces += meshlets[i].faceCount;
+        frame.cullStats.facesVisible += meshlets[i].faceCount;
       }
+      frame.cullStats.meshlets += meshlets.size();
+    }
+  }
 
-      if (lightningModel != LIGHTNING_MODE_SMOOTH) {
-        glBegin(GL_TRIANGLES);
-        glColor3f(lightning0, lightning0, lightning0);
-        glVertex3f(p0.x(), p0.y(), p0.z());
-        glVertex3f(p1.x(), p1.y(), p1.z());
-        glVertex3f(p2.x(), p2.y(), p2.z());
-        glEnd();
+  if (frame.occlusionMode != OCCLUSION_OFF) {
+    cullOccluded(frame, slot, viewProjection);
+  }
+
+  for (Instance3D& instance : globalScene.instances) {
+    Object3D& model = *instance.model;
+    const instanceFrame_t& instanceFrame = instance.frames[slot];
+    if (instanceFrame.lod >= model.meshletVisible.size()) continue;
+    std::vector<uint8_t>& visible = model.meshletVisible[instanceFrame.lod];
+    for (uint32_t i : instanceFrame.visibleMeshlets) visible[i] = 1;
+  }
+}
+
+void cullOccluded(frame_t& frame, size_t slot,
+                  const double viewProjection[16]) {
+  occlusion.mode = frame.occlusionMode;
+  occlusion.clear();
+  for (const Instance3D& instance : globalScene.instances) {
+    const Object3D& model = *instance.model;
+    const instanceFrame_t& instanceFrame = instance.frames[slot];
+    GLdouble transform[16], clip[16];
+    instance.getTransform(transform);
+    mat4::multiply(viewProjection, transform, clip);
+
+    // Conservative occluders are exactly the faces drawn this frame.
+    if (occlusion.mode == OCCLUSION_CONSERVATIVE) {
+      const size_t faceCount =
+          model.isCompact()
+              ? model.getCompact(instanceFrame.lod).getTriangleCount()
+              : model.getFaces(instanceFrame.lod).size();
+      occlusion.addOccluder(clip, model, instanceFrame.lod,
+                            getVisibleRanges(instance, slot, faceCount));
+    } else {
+      const size_t lod = model.getLodCount() - 1;
+      const size_t faceCount = model.isCompact()
+                                   ? model.getCompact(lod).getTriangleCount()
+                                   : model.getFaces(lod).size();
+      occlusion.addOccluder(clip, model, lod,
+                            {{0, (uint32_t)faceCount, UINT32_MAX}});
+    }
+  }
+  occlusion.rasterize();
+
+  for (Instance3D& instance : globalScene.instances) {
+    const Object3D& model = *instance.model;
+    instanceFrame_t& instanceFrame = instance.frames[slot];
+    if (instanceFrame.lod >= model.meshlets.size()) continue;
+    const std::vector<meshlet_t>& meshlets = model.meshlets[instanceFrame.lod];
+    GLdouble transform[16], clip[16];
+    instance.getTransform(transform);
+    mat4::multiply(viewProjection, transform, clip);
+
+    // The whole model first, then every meshlet that survived.
+    const dVector3D extent(model.boundsRadius, model.boundsRadius,
+                           model.boundsRadius);
+    const bool modelVisible = occlusion.isBoxVisible(
+        clip, model.boundsCenter - extent, model.boundsCenter + extent);
+    size_t kept = 0;
+    for (uint32_t i : instanceFrame.visibleMeshlets) {
+      const meshlet_t& meshlet = meshlets[i];
+      const dVector3D radius(meshlet.radius, meshlet.radius, meshlet.radius);
+      if (modelVisible && occlusion.isBoxVisible(clip, meshlet.center - radius,
+                                                 meshlet.center + radius)) {
+        instanceFrame.visibleMeshlets[kept++] = i;
       } else {
-        glBegin(GL_TRIANGLES);
-        glColor3f(lightning0, lightning0, lightning0);
-        glVertex3f(p0.x(), p0.y(), p0.z());
-        glColor3f(lightning1, lightning1, lightning1);
-        glVertex3f(p1.x(), p1.y(), p1.z());
-        glColor3f(lightning2, lightning2, lightning2);
-        glVertex3f(p2.x(), p2.y(), p2.z());
-        glEnd();
+        frame.cullStats.occlusionCulled++;
+        frame.cullStats.facesVisible -= meshlet.faceCount;
       }
     }
+    instanceFrame.visibleMeshlets.resize(kept);
   }
 }
 
-void renderWithTexture() {
-  for (Object3D& model : globalScene.models) {
-    for (ObjectFace3D& face : model.faces) {
-      const dVector3D& p0 = face.p0;
-      const dVector3D& p1 = face.p1;
-      const dVector3D& p2 = face.p2;
-      ColorRGB& color0 = face.color0;
-      ColorRGB& color1 = face.color1;
-      ColorRGB& color2 = face.color2;
-      if (lightningModel == LIGHTNING_MODE_OFF) {
-        color0 = ColorRGB(1, 1, 1);
-        color1 = ColorRGB(1, 1, 1);
-        color2 = ColorRGB(1, 1, 1);
-      }
+void renderWireframe(const frame_t& frame, size_t slot) {
+  glColor3f(1, 1, 1);
+  for (const Instance3D& instance : globalScene.instances) {
+    Object3D& model = *instance.model;
+    glPushMatrix();
+    applyInstanceTransform(instance);
+    if (model.isCompact()) {
+      renderCompactModel(model, instance, frame, slot);
+      glPopMatrix();
+      continue;
+    }
+    faceList_t& faces = model.getFaces(instance.frames[slot].lod);
+    for (const faceRange_t& range :
+         getVisibleRanges(instance, slot, faces.size())) {
+      for (size_t i = range.begin; i < range.end; ++i) {
+        ObjectFace3D& face = faces[i];
+        glBegin(GL_LINES);
+        glVertex3f(face.p0.x(), face.p0.y(), face.p0.z());
+        glVertex3f(face.p1.x(), face.p1.y(), face.p1.z());
+        glEnd();
+        glBegin(GL_LINES);
+        glVertex3f(face.p1.x(), face.p1.y(), face.p1.z());
+        glVertex3f(face.p2.x(), face.p2.y(), face.p2.z());
+        glEnd();
+        glBegin(GL_LINES);
+        glVertex3f(face.p2.x(), face.p2.y(), face.p2.z());
+        glVertex3f(face.p0.x(), face.p0.y(), face.p0.z());
+        glEnd();
 
-      if (lightningModel != LIGHTNING_MODE_SMOOTH) {
-        glBindTexture(GL_TEXTURE_2D, model.texture.textureRef);
-        glBegin(GL_TRIANGLES);
-        glColor3d(color0.red, color0.green, color0.blue);
-        glTexCoord2d(face.t0.x(), face.t0.y());
-        glVertex3d(p0.x(), p0.y(), p0.z());
-        glTexCoord2d(face.t1.x(), face.t1.y());
-        glVertex3d(p1.x(), p1.y(), p1.z());
-        glTexCoord2d(face.t2.x(), face.t2.y());
-        glVertex3d(p2.x(), p2.y(), p2.z());
+        glColor3d(1, 1, 0);
+        glBegin(GL_LINES);
+        dVector3D f = (face.p0 + (face.p0n * 0.1));
+        glVertex3f(face.p0.x(), face.p0.y(), face.p0.z());
+        glVertex3f(f.x(), f.y(), f.z());
         glEnd();
-      } else {
-        glBindTexture(GL_TEXTURE_2D, model.texture.textureRef);
-        glBegin(GL_TRIANGLES);
-        glColor3d(color0.red, color0.green, color0.blue);
-        glTexCoord2d(face.t0.x(), face.t0.y());
-        glVertex3d(p0.x(), p0.y(), p0.z());
-        glColor3d(color1.red, color1.green, color1.blue);
-        glTexCoord2d(face.t1.x(), face.t1.y());
-        glVertex3d(p1.x(), p1.y(), p1.z());
-        glColor3d(color2.red, color2.green, color2.blue);
-        glTexCoord2d(face.t2.x(), face.t2.y());
-        glVertex3d(p2.x(), p2.y(), p2.z());
+        glBegin(GL_LINES);
+        f = (face.p1 + (face.p1n * 0.1));
+        glVertex3f(face.p1.x(), face.p1.y(), face.p1.z());
+        glVertex3f(f.x(), f.y(), f.z());
+        glEnd();
+        glBegin(GL_LINES);
+        f = (face.p2 + (face.p2n * 0.1));
+        glVertex3f(face.p2.x(), face.p2.y(), face.p2.z());
+        glVertex3f(f.x(), f.y(), f.z());
+        glEnd();
+        glColor3d(1, 1, 1);
+
+        glColor3d(0, 1, 1);
+        glBegin(GL_LINES);
+        dVector3D lightPos = globalScene.lights[0].position;
+        f = (face.p0 * 0.9f) + (lightPos * 0.1f);
+        glVertex3f(face.p0.x(), face.p0.y(), face.p0.z());
+        glVertex3f(f.x(), f.y(), f.z());
+        glEnd();
+        glBegin(GL_LINES);
+        f = (face.p1 * 0.9f) + (lightPos * 0.1f);
+        glVertex3f(face.p1.x(), face.p1.y(), face.p1.z());
+        glVertex3f(f.x(), f.y(), f.z());
+        glEnd();
+        glBegin(GL_LINES);
+        f = (face.p2 * 0.9f) + (lightPos * 0.1f);
+        glVertex3f(face.p2.x(), face.p2.y(), face.p2.z());
+        glVertex3f(f.x(), f.y(), f.z());
         glEnd();
+        glColor3d(1, 1, 1);
+      }
+    }
+    glPopMatrix();
+  }
+}
+
+void renderWithGreyScale(const frame_t& frame, size_t slot) {
+  for (const Instance3D& instance : globalScene.instances) {
+    Object3D& model = *instance.model;
+    glPushMatrix();
+    applyInstanceTransform(instance);
+    if (model.isCompact()) {
+      renderCompactModel(model, instance, frame, slot);
+      glPopMatrix();
+      continue;
+    }
+
+    glBegin(GL_TRIANGLES);
+    const size_t lod = instance.frames[slot].lod;
+    const faceList_t& faces = model.getFaces(lod);
+    // Nothing was lit when lighting is off.
+    const lighting_t* lighting = frame.lightingMode == LIGHTNING_MODE_OFF
+                                     ? nullptr
+                                     : &model.lighting[slot][lod];
+    for (const faceRange_t& range :
+         getVisibleRanges(instance, slot, faces.size())) {
+      for (size_t i = range.begin; i < range.end; ++i) {
+        const ObjectFace3D& face = faces[i];
+        const dVector3D& p0 = face.p0;
+        const dVector3D& p1 = face.p1;
+        const dVector3D& p2 = face.p2;
+        ColorRGB lightning0 = toGreyScale(instance.tint);
+        ColorRGB lightning1 = lightning0;
+        ColorRGB lightning2 = lightning0;
+        if (frame.lightingMode == LIGHTNING_MODE_FLAT) {
+          lightning0 = toGreyScale(lighting->faceColors[i] * instance.tint);
+        } else if (frame.lightingMode == LIGHTNING_MODE_SMOOTH) {
+          const ColorRGB* colors = &lighting->vertexColors[i * 3];
+          lightning0 = toGreyScale(colors[0] * instance.tint);
+          lightning1 = toGreyScale(colors[1] * instance.tint);
+          lightning2 = toGreyScale(colors[2] * instance.tint);
+        }
+
+        if (frame.lightingMode != LIGHTNING_MODE_SMOOTH) {
+          glColor3f(lightning0.red, lightning0.green, lightning0.blue);
+          glVertex3f(p0.x(), p0.y(), p0.z());
+          glVertex3f(p1.x(), p1.y(), p1.z());
+          glVertex3f(p2.x(), p2.y(), p2.z());
+        } else {
+          glColor3f(lightning0.red, lightning0.green, lightning0.blue);
+          glVertex3f(p0.x(), p0.y(), p0.z());
+          glColor3f(lightning1.red, lightning1.green, lightning1.blue);
+          glVertex3f(p1.x(), p1.y(), p1.z());
+          glColor3f(lightning2.red, lightning2.green, lightning2.blue);
+          glVertex3f(p2.x(), p2.y(), p2.z());
+        }
+      }
+    }
+    glEnd();
+    glPopMatrix();
+  }
+}
+
+void renderWithTexture(const frame_t& frame, size_t slot) {
+  const Object3D* boundModel = nullptr;
+  for (const Instance3D& instance : globalScene.instances) {
+    Object3D& model = *instance.model;
+    // Instances are sorted by model, so the texture is bound once per mesh.
+    if (boundModel != &model) {
+      glBindTexture(GL_TEXTURE_2D, model.texture.textureRef);
+      boundModel = &model;
+    }
+    glPushMatrix();
+    applyInstanceTransform(instance);
+    if (model.isCompact()) {
+      renderCompactModel(model, instance, frame, slot);
+      glPopMatrix();
+      continue;
+    }
+
+    glBegin(GL_TRIANGLES);
+    const size_t lod = instance.frames[slot].lod;
+    const faceList_t& faces = model.getFaces(lod);
+    // Nothing was lit when lighting is off.
+    const lighting_t* lighting = frame.lightingMode == LIGHTNING_MODE_OFF
+                                     ? nullptr
+                                     : &model.lighting[slot][lod];
+    for (const faceRange_t& range :
+         getVisibleRanges(instance, slot, faces.size())) {
+      for (size_t i = range.begin; i < range.end; ++i) {
+        const ObjectFace3D& face = faces[i];
+        const dVector3D& p0 = face.p0;
+        const dVector3D& p1 = face.p1;
+        const dVector3D& p2 = face.p2;
+        ColorRGB color0 = instance.tint;
+        ColorRGB color1 = instance.tint;
+        ColorRGB color2 = instance.tint;
+        if (frame.lightingMode == LIGHTNING_MODE_FLAT) {
+          color0 = lighting->faceColors[i] * instance.tint;
+        } else if (frame.lightingMode == LIGHTNING_MODE_SMOOTH) {
+          const ColorRGB* colors = &lighting->vertexColors[i * 3];
+          color0 = colors[0] * instance.tint;
+          color1 = colors[1] * instance.tint;
+          color2 = colors[2] * instance.tint;
+        }
+
+        if (frame.lightingMode != LIGHTNING_MODE_SMOOTH) {
+          glColor3d(color0.red, color0.green, color0.blue);
+          glTexCoord2d(face.t0.x(), face.t0.y());
+          glVertex3d(p0.x(), p0.y(), p0.z());
+          glTexCoord2d(face.t1.x(), face.t1.y());
+          glVertex3d(p1.x(), p1.y(), p1.z());
+          glTexCoord2d(face.t2.x(), face.t2.y());
+          glVertex3d(p2.x(), p2.y(), p2.z());
+        } else {
+          glColor3d(color0.red, color0.green, color0.blue);
+          glTexCoord2d(face.t0.x(), face.t0.y());
+          glVertex3d(p0.x(), p0.y(), p0.z());
+          glColor3d(color1.red, color1.green, color1.blue);
+          glTexCoord2d(face.t1.x(), face.t1.y());
+          glVertex3d(p1.x(), p1.y(), p1.z());
+          glColor3d(color2.red, color2.green, color2.blue);
+          glTexCoord2d(face.t2.x(), face.t2.y());
+          glVertex3d(p2.x(), p2.y(), p2.z());
+        }
+      }
+    }
+    glEnd();
+    glPopMatrix();
+  }
+}
+
+void renderCompactModel(Object3D& model, const Instance3D& instance,
+                        const frame_t& frame, size_t slot) {
+  static std::vector<ColorRGB> shadedColors;
+  const size_t lod = instance.frames[slot].lod;
+  const CompactMesh& mesh = model.getCompact(lod);
+  const ColorRGB& tint = instance.tint;
+  const bool greyScale = renderMethod == RENDER_GRAY_SCALE;
+  const bool tinted = tint.red != 1 || tint.green != 1 || tint.blue != 1;
+  const compactVertex_t* vertices = mesh.vertices.data();
+  const GLsizei stride = sizeof(compactVertex_t);
+  const std::vector<faceRange_t>& ranges =
+      getVisibleRanges(instance, slot, mesh.getTriangleCount());
+  auto drawElements = [&]() {
+    for (const faceRange_t& range : ranges) {
+      glDrawElements(GL_TRIANGLES, (range.end - range.begin) * 3,
+                     GL_UNSIGNED_INT, mesh.indices.data() + range.begin * 3);
+    }
+  };
+
+  // Dequantization is folded into the modelview and texture matrices so the
+  // 16 bit attributes are fed to GL as they are.
+  glMatrixMode(GL_TEXTURE);
+  glPushMatrix();
+  glTranslated(mesh.uvMin.x(), mesh.uvMin.y(), 0);
+  glScaled(mesh.uvExtent.x() / COMPACT_UV_RANGE,
+           mesh.uvExtent.y() / COMPACT_UV_RANGE, 1);
+  glTranslated(COMPACT_UV_BIAS, COMPACT_UV_BIAS, 0);
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glTranslated(mesh.positionCenter.x(), mesh.positionCenter.y(),
+               mesh.positionCenter.z());
+  glScaled(mesh.positionHalfExtent.x() / COMPACT_POSITION_RANGE,
+           mesh.positionHalfExtent.y() / COMPACT_POSITION_RANGE,
+           mesh.positionHalfExtent.z() / COMPACT_POSITION_RANGE);
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glVertexPointer(3, GL_SHORT, stride, vertices[0].position);
+  if (renderMethod == RENDER_TEXTURED) {
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glTexCoordPointer(2, GL_SHORT, stride, vertices[0].uv);
+  }
+
+  if (renderMethod == RENDER_WIREFRAME) {
+    glColor3f(1, 1, 1);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    drawElements();
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  } else if (frame.lightingMode == LIGHTNING_MODE_FLAT) {
+    const lighting_t& lighting = model.lighting[slot][lod];
+    // Shared vertices can't carry per face colors, so flat shading still
+    // goes face by face.
+    glBegin(GL_TRIANGLES);
+    for (const faceRange_t& range : ranges) {
+      for (size_t i = range.begin; i < range.end; ++i) {
+        const ColorRGB color = greyScale
+                                   ? toGreyScale(lighting.faceColors[i] * tint)
+                                   : lighting.faceColors[i] * tint;
+        glColor3f(color.red, color.green, color.blue);
+        glArrayElement(mesh.indices[i * 3]);
+        glArrayElement(mesh.indices[i * 3 + 1]);
+        glArrayElement(mesh.indices[i * 3 + 2]);
+      }
+    }
+    glEnd();
+  } else if (frame.lightingMode == LIGHTNING_MODE_SMOOTH) {
+    const lighting_t& lighting = model.lighting[slot][lod];
+    const ColorRGB* colors = lighting.vertexColors.data();
+    if (greyScale || tinted) {
+      shadedColors.resize(lighting.vertexColors.size());
+      std::transform(lighting.vertexColors.begin(), lighting.vertexColors.end(),
+                     shadedColors.begin(), [&](const ColorRGB& color) {
+                       return greyScale ? toGreyScale(color * tint)
+                                        : color * tint;
+                     });
+      colors = shadedColors.data();
+    }
+    glEnableClientState(GL_COLOR_ARRAY);
+    glColorPointer(3, GL_FLOAT, sizeof(ColorRGB), colors);
+    drawElements();
+    glDisableClientState(GL_COLOR_ARRAY);
+  } else {
+    const ColorRGB color = greyScale ? toGreyScale(tint) : tint;
+    glColor3f(color.red, color.green, color.blue);
+    drawElements();
+  }
+
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glPopMatrix();
+  glMatrixMode(GL_TEXTURE);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
+
+  if (renderMethod == RENDER_WIREFRAME) {
+    // Same normal and light lines as `renderWireframe`, decoded back to
+    // model space since the matrices above are popped.
+    const dVector3D lightPos = globalScene.lights[0].position;
+    glBegin(GL_LINES);
+    for (const faceRange_t& range : ranges) {
+      for (size_t i = range.begin * 3; i < range.end * 3; ++i) {
+        const dVector3D p = mesh.decodePosition(mesh.indices[i]);
+        const dVector3D n = p + (mesh.decodeNormal(mesh.indices[i]) * 0.1);
+        const dVector3D l = (p * 0.9f) + (lightPos * 0.1f);
+        glColor3d(1, 1, 0);
+        glVertex3f(p.x(), p.y(), p.z());
+        glVertex3f(n.x(), n.y(), n.z());
+        glColor3d(0, 1, 1);
+        glVertex3f(p.x(), p.y(), p.z());
+        glVertex3f(l.x(), l.y(), l.z());
       }
     }
+    glEnd();
+    glColor3d(1, 1, 1);
   }
 }
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <iostream>
+
+#include "compact_mesh.hpp"
+#include "memory_tracker.hpp"
+#include "models.hpp"
+#include "scene.hpp"
+
+// Resident bytes of one model, walked from its containers.
+typedef struct {
+  // `faces` and every LOD.
+  size_t faces;
+  size_t compact;
+  size_t meshlets;
+  // Both frame slots.
+  size_t lighting;
+} modelFootprint_t;
+
+class MemoryReport {
+ public:
+  static modelFootprint_t measure(const Object3D& model) {
+    modelFootprint_t footprint = {};
+    footprint.faces = model.faces.capacity() * sizeof(ObjectFace3D);
+    for (const faceList_t& lod : model.lods) {
+      footprint.faces += lod.capacity() * sizeof(ObjectFace3D);
+    }
+    for (const std::shared_ptr<CompactMesh>& mesh : model.compactLods) {
+      footprint.compact += mesh->getResidentBytes();
+    }
+    for (size_t lod = 0; lod < model.meshlets.size(); ++lod) {
+      footprint.meshlets += model.meshlets[lod].capacity() * sizeof(meshlet_t);
+    }
+    for (const std::vector<uint8_t>& visible : model.meshletVisible) {
+      footprint.meshlets += visible.capacity();
+    }
+    for (const std::vector<lighting_t>& slot : model.lighting) {
+      for (const lighting_t& lighting : slot) {
+        footprint.lighting += (lighting.faceColors.capacity() + lighting.vertexColors.capacity()) * sizeof(ColorRGB);
+      }
+    }
+    return footprint;
+  }
+
+  // Footprint of every model and instance, then the tracked bytes of every
+  // subsystem.
+  static void print(const Scene& scene, std::ostream& out) {
+    out << "Memory:" << std::endl;
+    for (const std::shared_ptr<Object3D>& model : scene.models) {
+      const modelFootprint_t f = measure(*model);
+      out << "  " << model->name << ": faces " << f.faces << ", compact " << f.compact << ", meshlets "
+          << f.meshlets << ", lighting " << f.lighting << ", total " << (f.faces + f.compact + f.meshlets + f.lighting)
+          << " bytes, load peak " << model->loadPeakBytes << std::endl;
+    }
+
+    size_t instanceBytes = scene.instances.capacity() * sizeof(Instance3D);
+    for (const Instance3D& instance : scene.instances) {
+      for (const instanceFrame_t& frame : instance.frames) {
+        instanceBytes += frame.visibleMeshlets.capacity() * sizeof(uint32_t);
+      }
+    }
+    out << "  " << scene.instances.size() << " instances: " << instanceBytes << " bytes" << std::endl;
+    MemoryStats::print(out);
+  }
+};
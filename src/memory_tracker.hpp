@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Set by the leak check build (see CMakeLists.txt), makes leaks fatal.
+#ifndef MEMORY_LEAK_CHECKS
+#define MEMORY_LEAK_CHECKS 0
+#endif
+
+typedef enum {
+  // Resident geometry: faces, LODs and compact meshes.
+  MEMORY_MESHES,
+  // Decoded texture pixels, until they are uploaded to GL.
+  MEMORY_TEXTURES,
+  // Temporary vectors of the OBJ loader, must be back to zero after loading.
+  MEMORY_LOADER,
+  // Per frame lighting results of every model.
+  MEMORY_LIGHTING,
+  MEMORY_CATEGORIES,
+} eMemoryCategory;
+
+typedef struct {
+  std::atomic<size_t> current{0};
+  std::atomic<size_t> peak{0};
+} memoryCounter_t;
+
+// Live and peak bytes of every category, kept up to date by `TrackedAllocator`
+// from any thread.
+class MemoryStats {
+ public:
+  static void allocate(eMemoryCategory category, size_t bytes) {
+    const size_t current = counters[category].current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    raisePeak(counters[category].peak, current);
+    raisePeak(totalPeak, totalCurrent.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+  }
+
+  static void deallocate(eMemoryCategory category, size_t bytes) {
+    counters[category].current.fetch_sub(bytes, std::memory_order_relaxed);
+    totalCurrent.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+
+  static size_t getCurrent(eMemoryCategory category) {
+    return counters[category].current.load(std::memory_order_relaxed);
+  }
+  static size_t getPeak(eMemoryCategory category) { return counters[category].peak.load(std::memory_order_relaxed); }
+  static size_t getTotalCurrent() { return totalCurrent.load(std::memory_order_relaxed); }
+  static size_t getTotalPeak() { return totalPeak.load(std::memory_order_relaxed); }
+
+  // Starts measuring the peak of a new phase, such as loading one model.
+  static void resetPeaks() {
+    for (memoryCounter_t& counter : counters) {
+      counter.peak.store(counter.current.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    totalPeak.store(getTotalCurrent(), std::memory_order_relaxed);
+  }
+
+  static const char* getName(eMemoryCategory category) {
+    static const char* names[MEMORY_CATEGORIES] = {"meshes", "textures", "loader", "lighting"};
+    return names[category];
+  }
+
+  // Reports the bytes of `category` still alive when it should be empty,
+  // fatal in leak check builds.
+  static void expectReleased(eMemoryCategory category, const char* when) {
+    const size_t bytes = getCurrent(category);
+    if (bytes == 0) return;
+    std::cout << "Memory: " << bytes << " " << getName(category) << " bytes still alive " << when << std::endl;
+#if MEMORY_LEAK_CHECKS
+    abort();
+#endif
+  }
+
+  static void print(std::ostream& out) {
+    for (int i = 0; i < MEMORY_CATEGORIES; ++i) {
+      const eMemoryCategory category = (eMemoryCategory)i;
+      out << "  " << getName(category) << ": " << getCurrent(category) << " bytes resident, "
+          << getPeak(category) << " peak" << std::endl;
+    }
+    out << "  total: " << getTotalCurrent() << " bytes resident, " << getTotalPeak() << " peak" << std::endl;
+  }
+
+ private:
+  static inline memoryCounter_t counters[MEMORY_CATEGORIES];
+  static inline std::atomic<size_t> totalCurrent{0};
+  static inline std::atomic<size_t> totalPeak{0};
+
+  static void raisePeak(std::atomic<size_t>& peak, size_t value) {
+    size_t previous = peak.load(std::memory_order_relaxed);
+    while (previous < value && !peak.compare_exchange_weak(previous, value, std::memory_order_relaxed)) {
+    }
+  }
+};
+
+// `std::allocator` that accounts every allocation to `Category`.
+template <typename T, eMemoryCategory Category>
+class TrackedAllocator {
+ public:
+  typedef T value_type;
+
+  template <typename U>
+  struct rebind {
+    typedef TrackedAllocator<U, Category> other;
+  };
+
+  TrackedAllocator() noexcept {}
+  template <typename U>
+  TrackedAllocator(const TrackedAllocator<U, Category>&) noexcept {}
+
+  T* allocate(size_t count) {
+    T* data = std::allocator<T>().allocate(count);
+    MemoryStats::allocate(Category, count * sizeof(T));
+    return data;
+  }
+
+  void deallocate(T* data, size_t count) noexcept {
+    MemoryStats::deallocate(Category, count * sizeof(T));
+    std::allocator<T>().deallocate(data, count);
+  }
+
+  template <typename U>
+  bool operator==(const TrackedAllocator<U, Category>&) const noexcept {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const TrackedAllocator<U, Category>&) const noexcept {
+    return false;
+  }
+};
+
+template <typename T, eMemoryCategory Category>
+using trackedVector = std::vector<T, TrackedAllocator<T, Category>>;
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <iostream>
+#include <vector>
+
+#include "indexed_mesh.hpp"
+#include "models.hpp"
+
+#define VERTEX_CACHE_SIZE 32
+#define ACMR_FIFO_SIZE 16
+
+// Load-time face reordering, triangles are sorted for post-transform vertex
+// cache reuse (Tom Forsyth, "Linear-Speed Vertex Cache Optimisation"). Runs
+// after meshlets are built and only moves faces within a meshlet, so the
+// order it reports is the order drawn.
+// Vertices need no pass of their own: compact meshes number them by first
+// use in the final face order (see `IndexedMesh::fromFaces`), so consecutive
+// faces already touch nearby memory.
+//
+// Every function only touches the mesh it receives, so meshes can be
+// optimized concurrently.
+class MeshOptimizer {
+ public:
+  typedef struct {
+    size_t faces;
+    size_t meshlets;
+    double acmrBefore;
+    double acmrAfter;
+  } optimizeStats_t;
+
+  // Returns the triangles of `indices`, by index, in cache friendly order.
+  static std::vector<uint32_t> optimizeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount) {
+    const size_t triangleCount = indices.size() / 3;
+    std::vector<uint32_t> result;
+    result.reserve(triangleCount);
+    if (triangleCount == 0) return result;
+
+    // Vertex -> triangles adjacency in CSR form.
+    std::vector<uint32_t> offsets(vertexCount + 1, 0);
+    for (uint32_t v : indices) offsets[v + 1]++;
+    for (size_t i = 0; i < vertexCount; ++i) offsets[i + 1] += offsets[i];
+    std::vector<uint32_t> adjacency(indices.size());
+    std::vector<uint32_t> remaining(vertexCount, 0);
+    for (size_t i = 0; i < indices.size(); ++i) {
+      const uint32_t v = indices[i];
+      adjacency[offsets[v] + remaining[v]++] = (uint32_t)(i / 3);
+    }
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> vertexScore(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v) {
+      vertexScore[v] = scoreVertex(cachePosition[v], remaining[v]);
+    }
+
+    std::vector<float> triangleScore(triangleCount);
+    std::vector<bool> emitted(triangleCount, false);
+    for (size_t t = 0; t < triangleCount; ++t) {
+      triangleScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] +
+                         vertexScore[indices[t * 3 + 2]];
+    }
+
+    std::vector<uint32_t> cache;
+    std::vector<uint32_t> nextCache;
+    cache.reserve(VERTEX_CACHE_SIZE + 3);
+    nextCache.reserve(VERTEX_CACHE_SIZE + 3);
+
+    size_t scanCursor = 0;
+    int64_t best = -1;
+    for (size_t emittedCount = 0; emittedCount < triangleCount; ++emittedCount) {
+      if (best < 0) {
+        // Nothing adjacent to the cache, continue with the next unused face.
+        while (emitted[scanCursor]) ++scanCursor;
+        best = (int64_t)scanCursor;
+      }
+
+      const uint32_t* tri = &indices[best * 3];
+      emitted[best] = true;
+      result.push_back((uint32_t)best);
+
+      nextCache.assign(tri, tri + 3);
+      for (uint32_t v : cache) {
+        if (v != tri[0] && v != tri[1] && v != tri[2]) nextCache.push_back(v);
+      }
+
+      for (size_t i = 0; i < 3; ++i) {
+        const uint32_t v = tri[i];
+        uint32_t* begin = &adjacency[offsets[v]];
+        uint32_t* end = begin + remaining[v];
+        *std::find(begin, end, (uint32_t)best) = *(end - 1);
+        remaining[v]--;
+      }
+
+      for (size_t i = 0; i < nextCache.size(); ++i) {
+        const uint32_t v = nextCache[i];
+        cachePosition[v] = i < VERTEX_CACHE_SIZE ? (int)i : -1;
+      }
+
+      best = -1;
+      float bestScore = -1;
+      for (uint32_t v : nextCache) {
+        const float score = scoreVertex(cachePosition[v], remaining[v]);
+        const float delta = score - vertexScore[v];
+        vertexScore[v] = score;
+        for (uint32_t k = 0; k < remaining[v]; ++k) {
+          const uint32_t t = adjacency[offsets[v] + k];
+          triangleScore[t] += delta;
+          if (triangleScore[t] > bestScore) {
+            bestScore = triangleScore[t];
+            best = t;
+          }
+        }
+      }
+
+      if (nextCache.size() > VERTEX_CACHE_SIZE) nextCache.resize(VERTEX_CACHE_SIZE);
+      std::swap(cache, nextCache);
+    }
+    return result;
+  }
+
+  // Average cache miss ratio (transformed vertices per triangle) of a FIFO
+  // post-transform cache.
+  static double computeACMR(const std::vector<uint32_t>& indices, size_t vertexCount,
+                            size_t cacheSize = ACMR_FIFO_SIZE) {
+    if (indices.empty()) return 0;
+    std::vector<size_t> insertedAt(vertexCount, 0);
+    size_t timestamp = cacheSize + 1;
+    size_t misses = 0;
+    for (uint32_t v : indices) {
+      if (timestamp - insertedAt[v] > cacheSize) {
+        insertedAt[v] = timestamp++;
+        misses++;
+      }
+    }
+    return (double)misses / (indices.size() / 3);
+  }
+
+  // Reorders the faces inside every one of `meshlets` (the whole mesh when
+  // there are none), meshlets keep their ranges and bounds.
+  static optimizeStats_t optimizeFaces(faceList_t& faces, const std::vector<meshlet_t>& meshlets) {
+    IndexedMesh mesh = IndexedMesh::fromFaces(faces);
+    optimizeStats_t stats;
+    stats.faces = mesh.getTriangleCount();
+    stats.meshlets = meshlets.size();
+    stats.acmrBefore = computeACMR(mesh.indices, mesh.getVertexCount());
+
+    std::vector<meshlet_t> ranges = meshlets;
+    if (ranges.empty()) {
+      ranges.push_back(meshlet_t());
+      ranges[0].firstFace = 0;
+      ranges[0].faceCount = (uint32_t)faces.size();
+    }
+
+    // Faces are moved as they are, the indexed view is only used to score
+    // them. Vertices are renumbered per meshlet so the optimizer's tables
+    // stay meshlet sized.
+    const uint32_t unused = UINT32_MAX;
+    std::vector<uint32_t> local(mesh.getVertexCount(), unused);
+    std::vector<uint32_t> used;
+    std::vector<uint32_t> localIndices;
+    std::vector<uint32_t> indices;
+    indices.reserve(mesh.indices.size());
+    faceList_t reordered;
+    reordered.reserve(faces.size());
+    for (const meshlet_t& range : ranges) {
+      used.clear();
+      localIndices.clear();
+      for (size_t k = range.firstFace * 3; k < (range.firstFace + range.faceCount) * 3; ++k) {
+        const uint32_t v = mesh.indices[k];
+        if (local[v] == unused) {
+          local[v] = (uint32_t)used.size();
+          used.push_back(v);
+        }
+        localIndices.push_back(local[v]);
+      }
+      for (uint32_t t : optimizeVertexCache(localIndices, used.size())) {
+        const size_t f = range.firstFace + t;
+        indices.insert(indices.end(), &mesh.indices[f * 3], &mesh.indices[f * 3] + 3);
+        reordered.push_back(faces[f]);
+      }
+      for (uint32_t v : used) local[v] = unused;
+    }
+    faces.swap(reordered);
+    stats.acmrAfter = computeACMR(indices, mesh.getVertexCount());
+    return stats;
+  }
+
+  // Optimizes the full resolution mesh and every LOD of `model` in parallel,
+  // within the meshlets of each one when they are built.
+  static void optimizeModel(Object3D& model) {
+    static const std::vector<meshlet_t> none;
+    auto getMeshlets = [&model](size_t lod) -> const std::vector<meshlet_t>& {
+      return lod < model.meshlets.size() ? model.meshlets[lod] : none;
+    };
+    std::vector<std::future<optimizeStats_t>> jobs;
+    jobs.push_back(std::async(std::launch::async, [&]() { return optimizeFaces(model.faces, getMeshlets(0)); }));
+    for (size_t i = 0; i < model.lods.size(); ++i) {
+      jobs.push_back(std::async(std::launch::async,
+                                [&, i]() { return optimizeFaces(model.lods[i], getMeshlets(i + 1)); }));
+    }
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      const optimizeStats_t stats = jobs[i].get();
+      std::cout << "Face order LOD " << i << ": " << stats.faces << " faces in " << stats.meshlets
+                << " meshlets, ACMR " << stats.acmrBefore << " -> " << stats.acmrAfter << std::endl;
+    }
+  }
+
+ private:
+  static float scoreVertex(int cachePosition, uint32_t remainingTriangles) {
+    if (remainingTriangles == 0) return -1.0f;
+
+    float score = 0.0f;
+    if (cachePosition >= 0) {
+      if (cachePosition < 3) {
+        // The last triangle's vertices get a fixed score so it isn't reused
+        // right away, which would be a strip with bad locality.
+        score = 0.75f;
+      } else {
+        const float scaler = 1.0f / (VERTEX_CACHE_SIZE - 3);
+        score = std::pow(1.0f - (cachePosition - 3) * scaler, 1.5f);
+      }
+    }
+    // Boost vertices with few triangles left so they're finished off.
+    score += 2.0f * std::pow((float)remainingTriangles, -0.5f);
+    return score;
+  }
+};
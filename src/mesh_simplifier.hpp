@@ -0,0 +1,325 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include "geom.hpp"
+#include "indexed_mesh.hpp"
+#include "models.hpp"
+
+#define LOD_DEFAULT_LEVELS 4
+#define LOD_DEFAULT_RATIO 0.5
+#define LOD_MIN_FACES 64
+// Screen diameter (in pixels) at which the full resolution mesh is used,
+// every halving of the projected size drops one LOD.
+#define LOD_FULL_DETAIL_PIXELS 400.0
+
+// Quadric error metric simplifier (Garland & Heckbert) working on the
+// triangle soup stored in `Object3D::faces`.
+//
+// Corners are welded by position, uv and normal, so a position that carries
+// more than one set of attributes (uv seams, hard edges) or lies on an open
+// boundary is locked in place and only ever used as a collapse target.
+class MeshSimplifier {
+  struct Quadric {
+    // Upper triangle of the symmetric 4x4 matrix.
+    double m[10] = {0};
+
+    static Quadric fromPlane(double a, double b, double c, double d, double w) {
+      Quadric q;
+      q.m[0] = w * a * a; q.m[1] = w * a * b; q.m[2] = w * a * c; q.m[3] = w * a * d;
+      q.m[4] = w * b * b; q.m[5] = w * b * c; q.m[6] = w * b * d;
+      q.m[7] = w * c * c; q.m[8] = w * c * d;
+      q.m[9] = w * d * d;
+      return q;
+    }
+
+    Quadric& operator+=(const Quadric& other) {
+      for (size_t i = 0; i < 10; ++i) m[i] += other.m[i];
+      return *this;
+    }
+
+    double evaluate(const dVector3D& p) const {
+      const double x = p.x(), y = p.y(), z = p.z();
+      return m[0] * x * x + 2 * m[1] * x * y + 2 * m[2] * x * z + 2 * m[3] * x +
+             m[4] * y * y + 2 * m[5] * y * z + 2 * m[6] * y +
+             m[7] * z * z + 2 * m[8] * z + m[9];
+    }
+  };
+
+  struct Vertex {
+    dVector3D position;
+    dVector3D uv;
+    dVector3D normal;
+    Quadric quadric;
+    std::vector<uint32_t> faces;
+    uint32_t version = 0;
+    bool locked = false;
+    bool removed = false;
+  };
+
+  struct Triangle {
+    uint32_t v[3];
+    bool removed = false;
+
+    bool has(uint32_t idx) const { return v[0] == idx || v[1] == idx || v[2] == idx; }
+  };
+
+  struct Collapse {
+    double error;
+    uint32_t from, to;
+    uint32_t fromVersion, toVersion;
+    // Interpolation factor from `to` (0) towards `from` (1).
+    double t;
+
+    bool operator>(const Collapse& other) const { return error > other.error; }
+  };
+
+  typedef std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> collapseQueue_t;
+
+ public:
+  static faceList_t simplify(const faceList_t& faces, size_t targetFaces) {
+    std::vector<Vertex> vertices;
+    std::vector<Triangle> triangles;
+    std::vector<uint32_t> positionGroups;
+    weld(faces, vertices, triangles, positionGroups);
+    lockSeamsAndBorders(vertices, triangles, positionGroups);
+    computeQuadrics(vertices, triangles);
+
+    collapseQueue_t queue;
+    for (uint32_t i = 0; i < vertices.size(); ++i) {
+      pushVertexEdges(vertices, triangles, i, queue);
+    }
+
+    size_t liveFaces = triangles.size();
+    while (liveFaces > targetFaces && !queue.empty()) {
+      const Collapse c = queue.top();
+      queue.pop();
+
+      Vertex& from = vertices[c.from];
+      Vertex& to = vertices[c.to];
+      if (from.removed || to.removed) continue;
+      if (from.version != c.fromVersion || to.version != c.toVersion) continue;
+
+      const dVector3D position = lerp(to.position, from.position, c.t);
+      if (flipsAnyFace(vertices, triangles, c.from, c.to, position)) continue;
+
+      to.position = position;
+      to.uv = lerp(to.uv, from.uv, c.t);
+      if (c.t > 0) to.normal = ~lerp(to.normal, from.normal, c.t);
+      to.quadric += from.quadric;
+      to.version++;
+
+      for (uint32_t f : from.faces) {
+        Triangle& tri = triangles[f];
+        if (tri.removed) continue;
+        if (tri.has(c.to)) {
+          tri.removed = true;
+          --liveFaces;
+          continue;
+        }
+        for (uint32_t& v : tri.v) {
+          if (v == c.from) v = c.to;
+        }
+        to.faces.push_back(f);
+      }
+      from.removed = true;
+      from.faces.clear();
+
+      to.faces.erase(std::remove_if(to.faces.begin(), to.faces.end(),
+                                    [&](uint32_t f) { return triangles[f].removed; }),
+                     to.faces.end());
+      pushVertexEdges(vertices, triangles, c.to, queue);
+    }
+
+    faceList_t result;
+    result.reserve(liveFaces);
+    for (const Triangle& tri : triangles) {
+      if (tri.removed) continue;
+      const Vertex& a = vertices[tri.v[0]];
+      const Vertex& b = vertices[tri.v[1]];
+      const Vertex& c = vertices[tri.v[2]];
+      ObjectFace3D face;
+      face.p0 = a.position; face.p1 = b.position; face.p2 = c.position;
+      face.t0 = a.uv; face.t1 = b.uv; face.t2 = c.uv;
+      face.p0n = a.normal; face.p1n = b.normal; face.p2n = c.normal;
+      result.push_back(face);
+    }
+    return result;
+  }
+
+  // Fills `model.lods` with successively simplified copies of `model.faces`,
+  // stopping early once the mesh can't be reduced any further.
+  static void buildLodChain(Object3D& model, size_t levels = LOD_DEFAULT_LEVELS,
+                            double ratio = LOD_DEFAULT_RATIO) {
+    model.lods.clear();
+    model.lods.reserve(levels);
+    const faceList_t* previous = &model.faces;
+    for (size_t level = 1; level < levels; ++level) {
+      const size_t target = (size_t)(previous->size() * ratio);
+      if (target < LOD_MIN_FACES) break;
+
+      faceList_t lod = simplify(*previous, target);
+      if (lod.size() > previous->size() * 0.9) break;
+
+      model.lods.push_back(std::move(lod));
+      previous = &model.lods.back();
+    }
+
+    std::cout << "LOD chain: " << model.faces.size();
+    for (const faceList_t& lod : model.lods) {
+      std::cout << " -> " << lod.size();
+    }
+    std::cout << " faces" << std::endl;
+  }
+
+  // Picks the LOD from the diameter of the bounding sphere in pixels.
+  static size_t selectLod(const Object3D& model, double screenDiameter) {
+    const size_t coarsest = model.getLodCount() - 1;
+    if (coarsest == 0 || screenDiameter >= LOD_FULL_DETAIL_PIXELS) return 0;
+    if (screenDiameter <= 0) return coarsest;
+    const size_t level = (size_t)std::log2(LOD_FULL_DETAIL_PIXELS / screenDiameter);
+    return std::min(level, coarsest);
+  }
+
+ private:
+  static void weld(const faceList_t& faces, std::vector<Vertex>& vertices,
+                   std::vector<Triangle>& triangles, std::vector<uint32_t>& positionGroups) {
+    const IndexedMesh mesh = IndexedMesh::fromFaces(faces);
+    positionGroups = mesh.getPositionGroups();
+
+    vertices.resize(mesh.getVertexCount());
+    for (size_t i = 0; i < vertices.size(); ++i) {
+      vertices[i].position = mesh.positions[i];
+      vertices[i].uv = mesh.uvs[i];
+      vertices[i].normal = mesh.normals[i];
+    }
+
+    triangles.reserve(mesh.getTriangleCount());
+    for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+      Triangle tri;
+      tri.v[0] = mesh.indices[i];
+      tri.v[1] = mesh.indices[i + 1];
+      tri.v[2] = mesh.indices[i + 2];
+      if (tri.v[0] == tri.v[1] || tri.v[1] == tri.v[2] || tri.v[0] == tri.v[2]) continue;
+      const uint32_t f = (uint32_t)triangles.size();
+      for (uint32_t v : tri.v) vertices[v].faces.push_back(f);
+      triangles.push_back(tri);
+    }
+  }
+
+  static void lockSeamsAndBorders(std::vector<Vertex>& vertices, const std::vector<Triangle>& triangles,
+                                  const std::vector<uint32_t>& positionGroups) {
+    // Positions shared by more than one corner are attribute seams.
+    for (uint32_t i = 0; i < vertices.size(); ++i) {
+      if (positionGroups[i] != i) {
+        vertices[i].locked = true;
+        vertices[positionGroups[i]].locked = true;
+      }
+    }
+
+    // Edges used by a single triangle are open borders.
+    std::unordered_map<uint64_t, uint32_t> edges;
+    for (const Triangle& tri : triangles) {
+      for (size_t i = 0; i < 3; ++i) {
+        edges[edgeKey(tri.v[i], tri.v[(i + 1) % 3])]++;
+      }
+    }
+    for (const auto& edge : edges) {
+      if (edge.second != 1) continue;
+      vertices[(uint32_t)(edge.first >> 32)].locked = true;
+      vertices[(uint32_t)edge.first].locked = true;
+    }
+  }
+
+  static void computeQuadrics(std::vector<Vertex>& vertices, const std::vector<Triangle>& triangles) {
+    for (const Triangle& tri : triangles) {
+      const dVector3D& p0 = vertices[tri.v[0]].position;
+      const dVector3D cross = (vertices[tri.v[1]].position - p0) ^ (vertices[tri.v[2]].position - p0);
+      const double area = !cross;
+      if (area <= 0) continue;
+      const dVector3D n = cross * (1.0 / area);
+      const Quadric q = Quadric::fromPlane(n.x(), n.y(), n.z(), -(n % p0), area * 0.5);
+      for (uint32_t v : tri.v) vertices[v].quadric += q;
+    }
+  }
+
+  static void pushVertexEdges(const std::vector<Vertex>& vertices, const std::vector<Triangle>& triangles,
+                              uint32_t idx, collapseQueue_t& queue) {
+    for (uint32_t f : vertices[idx].faces) {
+      const Triangle& tri = triangles[f];
+      if (tri.removed) continue;
+      for (uint32_t other : tri.v) {
+        if (other == idx) continue;
+        Collapse c;
+        if (bestCollapse(vertices, idx, other, c)) queue.push(c);
+      }
+    }
+  }
+
+  static bool bestCollapse(const std::vector<Vertex>& vertices, uint32_t a, uint32_t b, Collapse& out) {
+    const Vertex& va = vertices[a];
+    const Vertex& vb = vertices[b];
+    if (va.locked && vb.locked) return false;
+
+    Quadric q = va.quadric;
+    q += vb.quadric;
+
+    out.error = INFINITY;
+    out.from = a;
+    out.to = b;
+    out.t = 0;
+    auto consider = [&](uint32_t from, uint32_t to, double t) {
+      const double error = q.evaluate(lerp(vertices[to].position, vertices[from].position, t));
+      if (error < out.error) {
+        out.error = error;
+        out.from = from;
+        out.to = to;
+        out.t = t;
+      }
+    };
+    if (!va.locked) consider(a, b, 0.0);
+    if (!vb.locked) consider(b, a, 0.0);
+    if (!va.locked && !vb.locked) consider(a, b, 0.5);
+
+    out.fromVersion = vertices[out.from].version;
+    out.toVersion = vertices[out.to].version;
+    return true;
+  }
+
+  static bool flipsAnyFace(const std::vector<Vertex>& vertices, const std::vector<Triangle>& triangles,
+                           uint32_t from, uint32_t to, const dVector3D& position) {
+    for (uint32_t idx : {from, to}) {
+      for (uint32_t f : vertices[idx].faces) {
+        const Triangle& tri = triangles[f];
+        if (tri.removed || (tri.has(from) && tri.has(to))) continue;
+
+        dVector3D before[3], after[3];
+        for (size_t i = 0; i < 3; ++i) {
+          before[i] = vertices[tri.v[i]].position;
+          after[i] = (tri.v[i] == from || tri.v[i] == to) ? position : before[i];
+        }
+        const dVector3D n0 = (before[1] - before[0]) ^ (before[2] - before[0]);
+        const dVector3D n1 = (after[1] - after[0]) ^ (after[2] - after[0]);
+        if ((n0 % n1) <= 0) return true;
+      }
+    }
+    return false;
+  }
+
+  static dVector3D lerp(const dVector3D& a, const dVector3D& b, double t) {
+    return (a * (1.0 - t)) + (b * t);
+  }
+
+  static uint64_t edgeKey(uint32_t a, uint32_t b) {
+    if (a > b) std::swap(a, b);
+    return ((uint64_t)a << 32) | b;
+  }
+};
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <queue>
+#include <vector>
+
+#include "culling.hpp"
+#include "geom.hpp"
+#include "indexed_mesh.hpp"
+#include "models.hpp"
+
+#define MESHLET_MAX_FACES 64
+// Cones wider than this (minimum cosine between the axis and any normal)
+// are never back facing as a whole, so they aren't worth testing.
+#define MESHLET_MIN_CONE_COSINE 0.1
+// Cost of a normal deviation of 90 degrees, in average edge lengths, when
+// growing meshlets. Higher values give tighter normal cones.
+#define MESHLET_NORMAL_WEIGHT 16.0
+
+typedef struct {
+  uint32_t begin;
+  uint32_t end;
+  // UINT32_MAX when the range is the whole mesh.
+  uint32_t meshlet;
+} faceRange_t;
+
+typedef struct {
+  size_t meshlets;
+  size_t frustumCulled;
+  size_t backfaceCulled;
+  size_t occlusionCulled;
+  size_t faces;
+  size_t facesVisible;
+} cullStats_t;
+
+// Splits meshes into meshlets of spatially close faces at load time and culls
+// them against the view every frame.
+class Meshlets {
+ public:
+  // Reorders `faces` so every meshlet is a contiguous range and returns them.
+  static std::vector<meshlet_t> build(faceList_t& faces) {
+    std::vector<meshlet_t> meshlets;
+    if (faces.empty()) return meshlets;
+
+    // Face adjacency through shared positions, so uv seams don't split
+    // meshlets.
+    const IndexedMesh mesh = IndexedMesh::fromFaces(faces);
+    const std::vector<uint32_t> groups = mesh.getPositionGroups();
+    std::vector<uint32_t> offsets(mesh.getVertexCount() + 1, 0);
+    for (uint32_t v : mesh.indices) offsets[groups[v] + 1]++;
+    for (size_t i = 0; i < mesh.getVertexCount(); ++i) offsets[i + 1] += offsets[i];
+    std::vector<uint32_t> adjacency(mesh.indices.size());
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < mesh.indices.size(); ++i) {
+      adjacency[fill[groups[mesh.indices[i]]]++] = (uint32_t)(i / 3);
+    }
+
+    std::vector<dVector3D> centroids(faces.size());
+    std::vector<dVector3D> normals(faces.size());
+    double edgeSum = 0;
+    for (size_t i = 0; i < faces.size(); ++i) {
+      centroids[i] = (faces[i].p0 + faces[i].p1 + faces[i].p2) * (1.0 / 3.0);
+      const dVector3D cross = (faces[i].p1 - faces[i].p0) ^ (faces[i].p2 - faces[i].p0);
+      const double area = !cross;
+      normals[i] = area > 0 ? dVector3D(cross * (1.0 / area)) : dVector3D(0, 0, 0);
+      edgeSum += !(faces[i].p1 - faces[i].p0);
+    }
+    // Distances are measured in average edges so the weight of the normal
+    // deviation doesn't depend on the model scale.
+    const double edge = std::max(edgeSum / faces.size(), 1e-12);
+
+    typedef std::pair<double, uint32_t> candidate_t;
+    std::vector<bool> assigned(faces.size(), false);
+    std::vector<uint32_t> order;
+    order.reserve(faces.size());
+    size_t seed = 0;
+
+    while (order.size() < faces.size()) {
+      while (assigned[seed]) ++seed;
+
+      // Grow from the seed, always taking the candidate closest to the
+      // meshlet centroid and normal so meshlets stay compact and their
+      // normal cones narrow.
+      meshlet_t meshlet;
+      meshlet.firstFace = (uint32_t)order.size();
+      meshlet.faceCount = 0;
+      dVector3D sum(0, 0, 0);
+      dVector3D normalSum(0, 0, 0);
+      std::priority_queue<candidate_t, std::vector<candidate_t>, std::greater<candidate_t>> candidates;
+      candidates.push(candidate_t(0.0, (uint32_t)seed));
+
+      while (!candidates.empty() && meshlet.faceCount < MESHLET_MAX_FACES) {
+        const uint32_t f = candidates.top().second;
+        candidates.pop();
+        if (assigned[f]) continue;
+
+        assigned[f] = true;
+        order.push_back(f);
+        meshlet.faceCount++;
+        sum = sum + centroids[f];
+        normalSum = normalSum + normals[f];
+        const dVector3D center = sum * (1.0 / meshlet.faceCount);
+        const double normalLength = !normalSum;
+        const dVector3D axis = normalLength > 0 ? dVector3D(normalSum * (1.0 / normalLength)) : normals[f];
+
+        for (size_t k = 0; k < 3; ++k) {
+          const uint32_t g = groups[mesh.indices[f * 3 + k]];
+          for (uint32_t a = offsets[g]; a < offsets[g + 1]; ++a) {
+            const uint32_t neighbour = adjacency[a];
+            if (assigned[neighbour]) continue;
+            const double distance = !(centroids[neighbour] - center) / edge;
+            const double deviation = 1.0 - (normals[neighbour] % axis);
+            candidates.push(candidate_t(distance + MESHLET_NORMAL_WEIGHT * deviation, neighbour));
+          }
+        }
+      }
+      meshlets.push_back(meshlet);
+    }
+
+    faceList_t reordered;
+    reordered.reserve(faces.size());
+    for (uint32_t f : order) reordered.push_back(faces[f]);
+    faces.swap(reordered);
+
+    for (meshlet_t& meshlet : meshlets) computeBounds(faces, meshlet);
+    return meshlets;
+  }
+
+  // Builds the meshlets of the full resolution mesh and every LOD.
+  static void buildModel(Object3D& model) {
+    model.meshlets.clear();
+    model.meshlets.push_back(build(model.faces));
+    for (faceList_t& lod : model.lods) {
+      model.meshlets.push_back(build(lod));
+    }
+    model.meshletVisible.resize(model.meshlets.size());
+    for (size_t lod = 0; lod < model.meshlets.size(); ++lod) {
+      model.meshletVisible[lod].assign(model.meshlets[lod].size(), 1);
+    }
+
+    std::cout << "Meshlets:";
+    for (const std::vector<meshlet_t>& meshlets : model.meshlets) {
+      std::cout << " " << meshlets.size();
+    }
+    std::cout << " (max " << MESHLET_MAX_FACES << " faces)" << std::endl;
+  }
+
+  // Fills `visible` with the meshlets of `meshlets` inside `frustum` and not
+  // facing away from its viewer, `frustum` must be in object space.
+  static void cull(const std::vector<meshlet_t>& meshlets, const ViewFrustum& frustum, bool backfaceCulling,
+                   std::vector<uint32_t>& visible, cullStats_t& stats) {
+    visible.clear();
+    for (uint32_t i = 0; i < meshlets.size(); ++i) {
+      const meshlet_t& meshlet = meshlets[i];
+      stats.meshlets++;
+      stats.faces += meshlet.faceCount;
+      if (!frustum.isSphereVisible(meshlet.center, meshlet.radius)) {
+        stats.frustumCulled++;
+        continue;
+      }
+      if (backfaceCulling &&
+          frustum.isConeBackfacing(meshlet.center, meshlet.radius, meshlet.coneAxis, meshlet.coneCutoff)) {
+        stats.backfaceCulled++;
+        continue;
+      }
+      stats.facesVisible += meshlet.faceCount;
+      visible.push_back(i);
+    }
+  }
+
+  static void accumulateStats(cullStats_t& total, const cullStats_t& frame) {
+    total.meshlets += frame.meshlets;
+    total.frustumCulled += frame.frustumCulled;
+    total.backfaceCulled += frame.backfaceCulled;
+    total.occlusionCulled += frame.occlusionCulled;
+    total.faces += frame.faces;
+    total.facesVisible += frame.facesVisible;
+  }
+
+  static void printStats(const cullStats_t& stats, size_t frames, std::ostream& out) {
+    if (frames == 0 || stats.meshlets == 0) return;
+    out << "meshlets per frame: " << stats.meshlets / frames << ", frustum culled "
+        << stats.frustumCulled / frames << ", backface culled " << stats.backfaceCulled / frames
+        << ", occlusion culled " << stats.occlusionCulled / frames
+        << ", faces visible " << stats.facesVisible / frames << " of " << stats.faces / frames << " ("
+        << (100.0 * stats.facesVisible / stats.faces) << "%)" << std::endl;
+  }
+
+ private:
+  static void computeBounds(const faceList_t& faces, meshlet_t& meshlet) {
+    const size_t end = meshlet.firstFace + meshlet.faceCount;
+
+    dVector3D lo = faces[meshlet.firstFace].p0;
+    dVector3D hi = lo;
+    dVector3D normalSum(0, 0, 0);
+    for (size_t f = meshlet.firstFace; f < end; ++f) {
+      for (const dVector3D* p : {&faces[f].p0, &faces[f].p1, &faces[f].p2}) {
+        for (size_t c = 0; c < 3; ++c) {
+          lo[c] = std::min(lo[c], (*p)[c]);
+          hi[c] = std::max(hi[c], (*p)[c]);
+        }
+      }
+      const dVector3D cross = (faces[f].p1 - faces[f].p0) ^ (faces[f].p2 - faces[f].p0);
+      const double area = !cross;
+      if (area > 0) normalSum = normalSum + (cross * (1.0 / area));
+    }
+
+    meshlet.center = (lo + hi) * 0.5;
+    meshlet.radius = 0;
+    for (size_t f = meshlet.firstFace; f < end; ++f) {
+      for (const dVector3D* p : {&faces[f].p0, &faces[f].p1, &faces[f].p2}) {
+        meshlet.radius = std::max(meshlet.radius, !(*p - meshlet.center));
+      }
+    }
+
+    meshlet.coneAxis = dVector3D(0, 0, 1);
+    meshlet.coneCutoff = 1.0;
+    const double length = !normalSum;
+    if (length <= 0) return;
+    meshlet.coneAxis = normalSum * (1.0 / length);
+
+    double minCosine = 1.0;
+    for (size_t f = meshlet.firstFace; f < end; ++f) {
+      const dVector3D cross = (faces[f].p1 - faces[f].p0) ^ (faces[f].p2 - faces[f].p0);
+      const double area = !cross;
+      if (area > 0) minCosine = std::min(minCosine, (cross % meshlet.coneAxis) / area);
+    }
+    if (minCosine > MESHLET_MIN_CONE_COSINE) {
+      meshlet.coneCutoff = std::sqrt(1.0 - minCosine * minCosine);
+    }
+  }
+};
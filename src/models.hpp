@@ -1,9 +1,13 @@
 #pragma once
 
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "colors.hpp"
+#include "frame_pipeline.hpp"
 #include "geom.hpp"
+#include "memory_tracker.hpp"
 
 #include "GL/glu.h"
 
@@ -13,10 +17,6 @@ public:
     dVector3D p1;
     dVector3D p2;
 
-    ColorRGB color0;
-    ColorRGB color1;
-    ColorRGB color2;
-
     dVector3D t0;
     dVector3D t1;
     dVector3D t2;
@@ -25,34 +25,166 @@ public:
     dVector3D p1n;
     dVector3D p2n;
 
+    // Baked ambient visibility of each corner, 1 when nothing occludes it,
+    // see ambient_occlusion.hpp.
+    float ao0 = 1;
+    float ao1 = 1;
+    float ao2 = 1;
+
     dVector3D getSurfaceNormal() const { return ~((p1 - p0) ^ (p2 - p0)); }
     dVector3D getVertex0Normal() const { return (p0 + p0n); }
     dVector3D getVertex1Normal() const { return (p1 + p1n); }
     dVector3D getVertex2Normal() const { return (p2 + p2n); }
 };
 
+typedef trackedVector<ObjectFace3D, MEMORY_MESHES> faceList_t;
+
+// Contiguous range of faces with the bounds used to cull it as a whole, see
+// meshlets.hpp.
+typedef struct {
+    uint32_t firstFace;
+    uint32_t faceCount;
+    dVector3D center;
+    double radius;
+    // Every face normal is within the cone around `coneAxis`, `coneCutoff`
+    // is the sine of its half angle (1 when it can't be culled).
+    dVector3D coneAxis;
+    double coneCutoff;
+} meshlet_t;
+
+// Lighting results of one LOD. Flat lighting fills `faceColors`, smooth
+// lighting fills `vertexColors`, one per face corner for `ObjectFace3D`
+// meshes and one per vertex for compact ones.
+typedef struct {
+    trackedVector<ColorRGB, MEMORY_LIGHTING> faceColors;
+    trackedVector<ColorRGB, MEMORY_LIGHTING> vertexColors;
+} lighting_t;
+
+// Finest mip level the instances of one frame need from a texture, see
+// texture_streamer.hpp.
+typedef struct {
+    size_t level;
+    // Projected diameter of the largest visible instance in pixels, 0 when
+    // none is visible.
+    double coverage;
+} textureRequest_t;
+
 class Texture2D {
 public:
+    // Source image, decoded and uploaded one mip level at a time by the
+    // texture streamer.
+    std::string path;
     size_t width{};
     size_t height{};
-    std::shared_ptr<uint8_t *> data;
+    size_t channels{3};
     GLuint textureRef{};
+    // One per frame in flight, written by the update thread.
+    textureRequest_t requests[FRAME_SLOTS] = {};
+
+    Texture2D() {}
+
+    Texture2D(std::string path, size_t width, size_t height, size_t channels)
+        : path(std::move(path)), width(width), height(height), channels(channels) {}
+};
+
+class CompactMesh;
+
+class Object3D {
+public:
+    // Source file, for reports.
+    std::string name;
+    faceList_t faces;
+    // Simplified versions of `faces`, each one coarser than the previous.
+    std::vector<faceList_t> lods;
+    // Quantized replacement of `faces` and `lods` (see compact_mesh.hpp),
+    // index 0 is the full resolution mesh.
+    std::vector<std::shared_ptr<CompactMesh>> compactLods;
+    // Bit N is set when an instance drew LOD N this frame, lighting is only
+    // computed for those.
+    uint32_t usedLods = 1;
+    // Meshlets of every LOD, and whether any instance sees them this frame.
+    std::vector<std::vector<meshlet_t>> meshlets;
+    std::vector<std::vector<uint8_t>> meshletVisible;
+    // Lighting results of every LOD for each frame in flight, the update
+    // thread writes one slot while the GL thread draws the other.
+    std::vector<lighting_t> lighting[FRAME_SLOTS];
+    Texture2D texture;
 
-    Texture2D() {
-        this->data = std::make_shared<uint8_t *>();
+    dVector3D boundsCenter = dVector3D(0, 0, 0);
+    double boundsRadius = 0;
+    // Highest tracked memory use while loading and processing the model.
+    size_t loadPeakBytes = 0;
+
+    bool isCompact() const { return !compactLods.empty(); }
+
+    size_t getLodCount() const { return isCompact() ? compactLods.size() : lods.size() + 1; }
+
+    // LOD 0 is the full resolution mesh, N is `lods[N - 1]`.
+    CompactMesh& getCompact(size_t lod) const {
+        return *compactLods[std::min(lod, compactLods.size() - 1)];
+    }
+
+    faceList_t& getFaces(size_t lod) {
+        return (lod == 0 || lods.empty()) ? faces : lods[std::min(lod, lods.size()) - 1];
+    }
+
+    const faceList_t& getFaces(size_t lod) const {
+        return (lod == 0 || lods.empty()) ? faces : lods[std::min(lod, lods.size()) - 1];
     }
 
-    Texture2D(size_t width, size_t height, std::vector<uint8_t> textureData)
-        : width(width), height(height) {
-        this->data = std::make_shared<uint8_t *>(new uint8_t[textureData.size()]);
-        for (size_t i = 0; i < textureData.size(); ++i) {
-            (*data)[i] = textureData[i];
+    void computeBounds() {
+        if (faces.empty()) return;
+        dVector3D lo = faces[0].p0;
+        dVector3D hi = faces[0].p0;
+        for (const ObjectFace3D& face : faces) {
+            for (const dVector3D* p : {&face.p0, &face.p1, &face.p2}) {
+                for (size_t i = 0; i < 3; ++i) {
+                    lo[i] = std::min(lo[i], (*p)[i]);
+                    hi[i] = std::max(hi[i], (*p)[i]);
+                }
+            }
         }
+        boundsCenter = (lo + hi) * 0.5;
+        boundsRadius = !(hi - lo) * 0.5;
     }
 };
 
-class Object3D {
+// Per frame culling results of an instance.
+typedef struct {
+    // Selected from `diameter`, the projected size of the bounds in pixels.
+    size_t lod;
+    double diameter;
+    // Meshlets of `lod` that passed culling.
+    std::vector<uint32_t> visibleMeshlets;
+} instanceFrame_t;
+
+// Placement of a shared `Object3D`, meshes and textures aren't copied so any
+// amount of instances cost the memory of a single model.
+class Instance3D {
 public:
-    std::vector<ObjectFace3D> faces;
-    Texture2D texture;
+    std::shared_ptr<Object3D> model;
+    dVector3D position = dVector3D(0, 0, 0);
+    // Degrees around the Y axis.
+    double rotation = 0;
+    double scale = 1;
+    // Material override, multiplied with the lit color.
+    ColorRGB tint = ColorRGB(1, 1, 1);
+    // One per frame in flight, see frame_pipeline.hpp.
+    instanceFrame_t frames[FRAME_SLOTS] = {};
+
+    Instance3D() {}
+
+    explicit Instance3D(std::shared_ptr<Object3D> model) : model(std::move(model)) {}
+
+    // Column major object to world matrix: translate * rotate Y * scale.
+    void getTransform(double out[16]) const {
+        const double yaw = rotation * PI / 180.0;
+        const double c = std::cos(yaw) * scale;
+        const double s = std::sin(yaw) * scale;
+        const double m[16] = {c, 0, -s, 0,
+                              0, scale, 0, 0,
+                              s, 0, c, 0,
+                              position.x(), position.y(), position.z(), 1};
+        std::copy(m, m + 16, out);
+    }
 };
@@ -0,0 +1,631 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define OCCLUSION_SSE2 1
+#else
+#define OCCLUSION_SSE2 0
+#endif
+
+#include "compact_mesh.hpp"
+#include "culling.hpp"
+#include "geom.hpp"
+#include "meshlets.hpp"
+#include "models.hpp"
+
+// Depth buffer resolution, the width must be a multiple of 4.
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 256
+#define OCCLUSION_MAX_THREADS 8
+// Below this many triangles the buffer is rasterized on the calling thread.
+#define OCCLUSION_MIN_PARALLEL_TRIANGLES 512
+// Models whose projected bounds are smaller than this, in depth buffer
+// pixels, aren't worth rasterizing as occluders.
+#define OCCLUSION_MIN_OCCLUDER_SIZE 16.0
+// Vertices closer than this `w` to the eye plane aren't projected.
+#define OCCLUSION_MIN_W 1e-5
+// Triangles reaching further than this out of the buffer are skipped, float
+// edge equations lose precision past it.
+#define OCCLUSION_GUARD_BAND 4096.0
+// Pixels within this distance of an outline count as crossed by it, well
+// above the error of the float edge equations inside the guard band.
+#define OCCLUSION_OUTLINE_MARGIN 1e-2
+// Band workers wait like the frame pipeline, spinning before sleeping.
+#define OCCLUSION_WORKER_SPINS 1024
+#define OCCLUSION_WORKER_SLEEP_US 50
+
+typedef enum {
+  OCCLUSION_OFF,
+  // Occluders are the front faces drawn this frame. A pixel only takes the
+  // farthest depth of the faces of an occluder overlapping it, and only
+  // when their outline doesn't cross it, so it is covered entirely and
+  // nothing visible is culled.
+  OCCLUSION_CONSERVATIVE,
+  // Occluders are the coarsest LOD with interpolated depth, cheaper but
+  // simplified silhouettes may hide geometry that is visible.
+  OCCLUSION_AGGRESSIVE,
+  OCCLUSION_END,
+} eOcclusionMode;
+
+// Low resolution CPU depth buffer of the occluders of a frame and its max
+// depth pyramid, used to reject bounds hidden behind them before lighting and
+// submission. Depth is NDC z, smaller is nearer.
+//
+// In conservative mode every occluder is resolved on its own: the front
+// faces of a connected mesh cover a pixel entirely when one of them holds
+// its center and no edge without a front facing neighbour beyond it (the
+// outline) comes near it, and then no point of the pixel is farther than
+// the farthest face overlapping it. Occluders are then merged by nearest.
+class OcclusionBuffer {
+ public:
+  eOcclusionMode mode = OCCLUSION_OFF;
+
+  OcclusionBuffer() {
+    size_t width = OCCLUSION_WIDTH, height = OCCLUSION_HEIGHT;
+    while (true) {
+      levels.push_back({width, height, std::vector<float>(width * height, 1.0f)});
+      if (width == 1 && height == 1) break;
+      width = std::max<size_t>(1, (width + 1) / 2);
+      height = std::max<size_t>(1, (height + 1) / 2);
+    }
+  }
+
+  ~OcclusionBuffer() {
+    stopping = true;
+    for (std::thread& worker : workers) worker.join();
+  }
+
+  void clear() {
+    triangles.clear();
+    occluders.clear();
+    segments.clear();
+  }
+
+  size_t getTriangleCount() const { return triangles.size(); }
+
+  // Queues the faces of `ranges` in `lod` of `model` as occluders, returns
+  // false when the model is too small on screen to be worth it.
+  bool addOccluder(const double clip[16], const Object3D& model, size_t lod,
+                   const std::vector<faceRange_t>& ranges) {
+    const dVector3D extent(model.boundsRadius, model.boundsRadius, model.boundsRadius);
+    screenRect_t rect;
+    if (!projectBox(clip, model.boundsCenter - extent, model.boundsCenter + extent, rect)) return false;
+    if (std::max(rect.maxX - rect.minX, rect.maxY - rect.minY) < OCCLUSION_MIN_OCCLUDER_SIZE) return false;
+
+    const bool compact = model.isCompact();
+    const CompactMesh* mesh = compact ? &model.getCompact(lod) : nullptr;
+    const faceList_t* faces = compact ? nullptr : &model.getFaces(lod);
+    const size_t faceCount = compact ? mesh->getTriangleCount() : faces->size();
+    auto getCorner = [&](size_t f, size_t k) -> dVector3D {
+      if (compact) return mesh->decodePosition(mesh->indices[f * 3 + k]);
+      const ObjectFace3D& face = (*faces)[f];
+      return k == 0 ? face.p0 : (k == 1 ? face.p1 : face.p2);
+    };
+
+    const bool conservative = mode == OCCLUSION_CONSERVATIVE;
+    pending.clear();
+    for (const faceRange_t& range : ranges) {
+      for (uint32_t f = range.begin; f < range.end; ++f) {
+        projected_t p;
+        p.face = f;
+        if (!projectTriangle(clip, getCorner(f, 0), getCorner(f, 1), getCorner(f, 2), p.v)) continue;
+        // Counter clockwise on screen is front facing, both windings
+        // occlude in aggressive mode.
+        if (conservative && !(getSide(p.v[0], p.v[1], p.v[2]) > 0)) continue;
+        pending.push_back(p);
+      }
+    }
+    if (!conservative) {
+      for (const projected_t& p : pending) addTriangle(p.v, false);
+      return true;
+    }
+
+    occluder_t occluder;
+    occluder.firstTriangle = triangles.size();
+    occluder.firstSegment = segments.size();
+    const std::vector<uint32_t>& neighbours =
+        getNeighbours(compact ? (const void*)mesh : (const void*)faces, faceCount, getCorner);
+    slots.resize(std::max(slots.size(), faceCount), UINT32_MAX);
+    for (uint32_t i = 0; i < pending.size(); ++i) slots[pending[i].face] = i;
+    for (const projected_t& p : pending) {
+      addTriangle(p.v, true);
+      for (size_t e = 0; e < 3; ++e) {
+        // An edge is outline unless a queued face continues past it.
+        const double* a = p.v[e];
+        const double* b = p.v[(e + 1) % 3];
+        const uint32_t n = neighbours[p.face * 3 + e];
+        const projected_t* other = n != UINT32_MAX && slots[n / 3] != UINT32_MAX ? &pending[slots[n / 3]] : nullptr;
+        if (other == nullptr || !(getSide(a, b, other->v[(n + 2) % 3]) < 0)) {
+          segments.push_back({{a[0], a[1]}, {b[0], b[1]}});
+        }
+      }
+    }
+    for (const projected_t& p : pending) slots[p.face] = UINT32_MAX;
+
+    occluder.endTriangle = triangles.size();
+    occluder.endSegment = segments.size();
+    occluder.minY = OCCLUSION_HEIGHT;
+    occluder.maxY = -1;
+    for (size_t i = occluder.firstTriangle; i < occluder.endTriangle; ++i) {
+      occluder.minY = std::min(occluder.minY, triangles[i].minY);
+      occluder.maxY = std::max(occluder.maxY, triangles[i].maxY);
+    }
+    if (occluder.minY <= occluder.maxY) occluders.push_back(occluder);
+    return true;
+  }
+
+  // Rasterizes the queued occluders in horizontal bands, one per worker
+  // started on first use, and builds the depth pyramid.
+  void rasterize() {
+    size_t threads = 1;
+    if (triangles.size() >= OCCLUSION_MIN_PARALLEL_TRIANGLES) {
+      threads = std::min<size_t>(OCCLUSION_MAX_THREADS, std::max(1u, std::thread::hardware_concurrency()));
+    }
+    if (threads > 1 && workers.empty()) {
+      bands.resize(threads);
+      for (size_t band = 1; band < threads; ++band) workers.emplace_back([this, band]() { runWorker(band); });
+    }
+    if (bands.empty()) bands.resize(1);
+
+    if (threads > 1) {
+      // Workers take the bands after the first, the calling thread the first.
+      const size_t count = bands.size();
+      bandRows = (int)((OCCLUSION_HEIGHT + count - 1) / count);
+      finished.store(0, std::memory_order_relaxed);
+      generation.fetch_add(1, std::memory_order_release);
+      rasterizeBand(bands[0], 0, std::min(bandRows, OCCLUSION_HEIGHT));
+      waitFor([&]() { return finished.load(std::memory_order_acquire) == workers.size(); });
+    } else {
+      rasterizeBand(bands[0], 0, OCCLUSION_HEIGHT);
+    }
+
+    for (size_t i = 1; i < levels.size(); ++i) {
+      const level_t& src = levels[i - 1];
+      level_t& dst = levels[i];
+      for (size_t y = 0; y < dst.height; ++y) {
+        const size_t y0 = std::min(y * 2, src.height - 1), y1 = std::min(y * 2 + 1, src.height - 1);
+        for (size_t x = 0; x < dst.width; ++x) {
+          const size_t x0 = std::min(x * 2, src.width - 1), x1 = std::min(x * 2 + 1, src.width - 1);
+          dst.depth[y * dst.width + x] =
+              std::max(std::max(src.depth[y0 * src.width + x0], src.depth[y0 * src.width + x1]),
+                       std::max(src.depth[y1 * src.width + x0], src.depth[y1 * src.width + x1]));
+        }
+      }
+    }
+  }
+
+  // False when the box from `lo` to `hi`, in the space `clip` transforms
+  // from, is behind the occluders everywhere it covers.
+  bool isBoxVisible(const double clip[16], const dVector3D& lo, const dVector3D& hi) const {
+    screenRect_t rect;
+    if (!projectBox(clip, lo, hi, rect)) return true;
+
+    // In conservative mode the neighbouring pixels are included too, so
+    // rounding of the projection can't leave part of the box untested.
+    const int grow = mode == OCCLUSION_CONSERVATIVE ? 1 : 0;
+    int x0 = (int)std::floor(rect.minX) - grow, x1 = (int)std::floor(rect.maxX) + grow;
+    int y0 = (int)std::floor(rect.minY) - grow, y1 = (int)std::floor(rect.maxY) + grow;
+    if (x1 < 0 || y1 < 0 || x0 >= OCCLUSION_WIDTH || y0 >= OCCLUSION_HEIGHT) return true;
+    x0 = std::max(x0, 0);
+    y0 = std::max(y0, 0);
+    x1 = std::min(x1, OCCLUSION_WIDTH - 1);
+    y1 = std::min(y1, OCCLUSION_HEIGHT - 1);
+
+    // Coarsest level where the rectangle covers at most 5x5 texels, coarser
+    // ones let a single uncovered pixel near the box keep it.
+    size_t level = 0;
+    while (level + 1 < levels.size() && (4 << level) < std::max(x1 - x0, y1 - y0) + 1) ++level;
+    const level_t& pyramid = levels[level];
+    float farthest = -1.0f;
+    for (size_t y = y0 >> level; y <= std::min((size_t)(y1 >> level), pyramid.height - 1); ++y) {
+      for (size_t x = x0 >> level; x <= std::min((size_t)(x1 >> level), pyramid.width - 1); ++x) {
+        farthest = std::max(farthest, pyramid.depth[y * pyramid.width + x]);
+      }
+    }
+    return rect.minZ <= farthest;
+  }
+
+ private:
+  typedef struct {
+    size_t width;
+    size_t height;
+    std::vector<float> depth;
+  } level_t;
+
+  typedef struct {
+    double minX, minY, maxX, maxY;
+    double minZ;
+  } screenRect_t;
+
+  // Edge and depth planes as (a, b, c) of a * x + b * y + c in pixels from
+  // (minX, minY), a pixel is covered when every edge is positive at its
+  // center. In conservative mode `grow` widens the edges to every pixel the
+  // triangle overlaps and `depth` is its farthest depth.
+  typedef struct {
+    float edges[3][3];
+    float grow[3];
+    float depth[3];
+    int minX, minY, maxX, maxY;
+  } triangle_t;
+
+  // Face of an occluder projected to depth buffer pixels.
+  typedef struct {
+    uint32_t face;
+    double v[3][3];
+  } projected_t;
+
+  typedef struct {
+    size_t faceCount;
+    // For every edge of every face (face * 3 + edge, edge k going from
+    // corner k to k + 1), the one edge of another face at the same positions
+    // or UINT32_MAX.
+    std::vector<uint32_t> edges;
+  } neighbours_t;
+
+  // Edge of the outline of an occluder, in pixels.
+  typedef struct {
+    double a[2];
+    double b[2];
+  } segment_t;
+
+  // Conservative mode: triangles and outline segments of one occluder, and
+  // the rows they touch.
+  typedef struct {
+    size_t firstTriangle, endTriangle;
+    size_t firstSegment, endSegment;
+    int minY, maxY;
+  } occluder_t;
+
+  // Per band scratch of one occluder at a time: farthest overlapping depth,
+  // center coverage (all bits set) and outline crossings of every pixel.
+  typedef struct {
+    std::vector<float> farthest;
+    std::vector<float> covered;
+    std::vector<uint8_t> outline;
+  } band_t;
+
+  std::vector<level_t> levels;
+  std::vector<triangle_t> triangles;
+  std::vector<occluder_t> occluders;
+  std::vector<segment_t> segments;
+  // Edge adjacency of every mesh used as an occluder, built on first use.
+  std::unordered_map<const void*, neighbours_t> neighbourCache;
+  // Scratch of `addOccluder`, `slots` maps faces to `pending` entries.
+  std::vector<projected_t> pending;
+  std::vector<uint32_t> slots;
+
+  // Band workers live as long as the buffer, `rasterize` bumps `generation`
+  // and waits for every worker to bump `finished`.
+  std::vector<band_t> bands;
+  std::vector<std::thread> workers;
+  std::atomic<size_t> generation{0};
+  std::atomic<size_t> finished{0};
+  std::atomic<bool> stopping{false};
+  int bandRows = OCCLUSION_HEIGHT;
+
+  // Clip space to depth buffer pixels, x and y in pixels and z in NDC.
+  static bool project(const double clip[16], const dVector3D& p, double out[3]) {
+    const double v[4] = {p.x(), p.y(), p.z(), 1};
+    double c[4];
+    mat4::transform(clip, v, c);
+    if (c[3] < OCCLUSION_MIN_W) return false;
+    out[0] = (c[0] / c[3] * 0.5 + 0.5) * OCCLUSION_WIDTH;
+    out[1] = (c[1] / c[3] * 0.5 + 0.5) * OCCLUSION_HEIGHT;
+    out[2] = c[2] / c[3];
+    return true;
+  }
+
+  // False when the box crosses the eye or near plane, it can't be tested
+  // then.
+  static bool projectBox(const double clip[16], const dVector3D& lo, const dVector3D& hi, screenRect_t& rect) {
+    rect.minX = rect.minY = rect.minZ = INFINITY;
+    rect.maxX = rect.maxY = -INFINITY;
+    for (int corner = 0; corner < 8; ++corner) {
+      const dVector3D p(corner & 1 ? hi.x() : lo.x(), corner & 2 ? hi.y() : lo.y(),
+                        corner & 4 ? hi.z() : lo.z());
+      double s[3];
+      if (!project(clip, p, s)) return false;
+      rect.minX = std::min(rect.minX, s[0]);
+      rect.maxX = std::max(rect.maxX, s[0]);
+      rect.minY = std::min(rect.minY, s[1]);
+      rect.maxY = std::max(rect.maxY, s[1]);
+      rect.minZ = std::min(rect.minZ, s[2]);
+    }
+    return rect.minZ >= -1.0;
+  }
+
+  // Skipping an occluder only makes culling less effective, never wrong.
+  static bool projectTriangle(const double clip[16], const dVector3D& p0, const dVector3D& p1, const dVector3D& p2,
+                              double v[3][3]) {
+    if (!project(clip, p0, v[0]) || !project(clip, p1, v[1]) || !project(clip, p2, v[2])) return false;
+    for (size_t i = 0; i < 3; ++i) {
+      if (std::fabs(v[i][0]) > OCCLUSION_GUARD_BAND || std::fabs(v[i][1]) > OCCLUSION_GUARD_BAND || v[i][2] < -1.0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Positive when `c` is left of the line from `a` to `b` on screen.
+  static double getSide(const double* a, const double* b, const double* c) {
+    return (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+  }
+
+  // Edge adjacency of the `faceCount` faces of `mesh`, matched by corner
+  // positions. Edges shared by more than two faces have no neighbour.
+  template <typename GetCorner>
+  const std::vector<uint32_t>& getNeighbours(const void* mesh, size_t faceCount, GetCorner getCorner) {
+    neighbours_t& cached = neighbourCache[mesh];
+    if (cached.faceCount == faceCount && cached.edges.size() == faceCount * 3) return cached.edges;
+    cached.faceCount = faceCount;
+    cached.edges.assign(faceCount * 3, UINT32_MAX);
+
+    // Corners with the same position get the same id.
+    std::vector<dVector3D> positions(faceCount * 3);
+    std::vector<uint32_t> order(faceCount * 3);
+    for (uint32_t c = 0; c < order.size(); ++c) {
+      positions[c] = getCorner(c / 3, c % 3);
+      order[c] = c;
+    }
+    auto lessPosition = [&](uint32_t a, uint32_t b) {
+      const dVector3D &p = positions[a], &q = positions[b];
+      return p[0] != q[0] ? p[0] < q[0] : (p[1] != q[1] ? p[1] < q[1] : p[2] < q[2]);
+    };
+    std::sort(order.begin(), order.end(), lessPosition);
+    std::vector<uint32_t> ids(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      ids[order[i]] = i > 0 && !lessPosition(order[i - 1], order[i]) ? ids[order[i - 1]] : (uint32_t)i;
+    }
+
+    typedef struct {
+      uint32_t lo, hi, edge;
+    } edgeKey_t;
+    std::vector<edgeKey_t> keys(faceCount * 3);
+    for (uint32_t e = 0; e < keys.size(); ++e) {
+      const uint32_t a = ids[e], b = ids[e / 3 * 3 + (e % 3 + 1) % 3];
+      keys[e] = {std::min(a, b), std::max(a, b), e};
+    }
+    std::sort(keys.begin(), keys.end(), [](const edgeKey_t& a, const edgeKey_t& b) {
+      return a.lo != b.lo ? a.lo < b.lo : (a.hi != b.hi ? a.hi < b.hi : a.edge < b.edge);
+    });
+    for (size_t i = 0; i < keys.size();) {
+      size_t j = i + 1;
+      while (j < keys.size() && keys[j].lo == keys[i].lo && keys[j].hi == keys[i].hi) ++j;
+      if (j - i == 2) {
+        cached.edges[keys[i].edge] = keys[i + 1].edge;
+        cached.edges[keys[i + 1].edge] = keys[i].edge;
+      }
+      i = j;
+    }
+    return cached.edges;
+  }
+
+  // `conservative` triangles keep their farthest depth and the widened
+  // edges, the others interpolate depth.
+  void addTriangle(const double (&projected)[3][3], bool conservative) {
+    double v[3][3];
+    std::copy(&projected[0][0], &projected[0][0] + 9, &v[0][0]);
+    double area = (v[1][0] - v[0][0]) * (v[2][1] - v[0][1]) - (v[2][0] - v[0][0]) * (v[1][1] - v[0][1]);
+    if (area == 0) return;
+    // Both windings occlude, counter clockwise is used for the edges.
+    if (area < 0) {
+      std::swap(v[1], v[2]);
+      area = -area;
+    }
+
+    // Conservative bounds take every pixel the triangle touches, plus the
+    // margin so none is lost to rounding.
+    const double margin = conservative ? OCCLUSION_OUTLINE_MARGIN : 0;
+    triangle_t t;
+    t.minX = std::max(0, (int)std::floor(std::min({v[0][0], v[1][0], v[2][0]}) - margin));
+    t.maxX = std::min(OCCLUSION_WIDTH - 1, (int)std::floor(std::max({v[0][0], v[1][0], v[2][0]}) + margin));
+    t.minY = std::max(0, (int)std::floor(std::min({v[0][1], v[1][1], v[2][1]}) - margin));
+    t.maxY = std::min(OCCLUSION_HEIGHT - 1, (int)std::floor(std::max({v[0][1], v[1][1], v[2][1]}) + margin));
+    if (t.minX > t.maxX || t.minY > t.maxY) return;
+
+    // Relative to the first pixel, so the float planes stay precise.
+    for (int e = 0; e < 3; ++e) {
+      const double* a = v[e];
+      const double* b = v[(e + 1) % 3];
+      const double dx = a[1] - b[1], dy = b[0] - a[0];
+      t.edges[e][0] = (float)dx;
+      t.edges[e][1] = (float)dy;
+      t.edges[e][2] = (float)(dx * (t.minX - a[0]) + dy * (t.minY - a[1]));
+      // Tested at the pixel corner most inside instead of its center.
+      t.grow[e] = (float)(0.5 * (std::fabs(dx) + std::fabs(dy)) + margin * std::sqrt(dx * dx + dy * dy));
+    }
+
+    if (conservative) {
+      const double farthest = std::max({v[0][2], v[1][2], v[2][2]});
+      t.depth[0] = t.depth[1] = 0;
+      t.depth[2] = (float)farthest;
+      // Rounded away from the occluder, never nearer than the face.
+      if (t.depth[2] < farthest) t.depth[2] = std::nextafter(t.depth[2], INFINITY);
+    } else {
+      const double dz1 = v[1][2] - v[0][2], dz2 = v[2][2] - v[0][2];
+      const double a = (dz1 * (v[2][1] - v[0][1]) - dz2 * (v[1][1] - v[0][1])) / area;
+      const double b = ((v[1][0] - v[0][0]) * dz2 - (v[2][0] - v[0][0]) * dz1) / area;
+      t.depth[0] = (float)a;
+      t.depth[1] = (float)b;
+      t.depth[2] = (float)(v[0][2] + a * (t.minX - v[0][0]) + b * (t.minY - v[0][1]));
+    }
+    triangles.push_back(t);
+  }
+
+  template <typename Condition>
+  bool waitFor(Condition ready) const {
+    for (size_t spin = 0; !ready(); ++spin) {
+      if (stopping.load(std::memory_order_relaxed)) return false;
+      if (spin < OCCLUSION_WORKER_SPINS) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(OCCLUSION_WORKER_SLEEP_US));
+      }
+    }
+    return true;
+  }
+
+  void runWorker(size_t band) {
+    for (size_t seen = 0;;) {
+      if (!waitFor([&]() { return generation.load(std::memory_order_acquire) != seen; })) return;
+      seen = generation.load(std::memory_order_acquire);
+      const int begin = (int)band * bandRows;
+      rasterizeBand(bands[band], begin, std::min(begin + bandRows, OCCLUSION_HEIGHT));
+      finished.fetch_add(1, std::memory_order_release);
+    }
+  }
+
+  void rasterizeBand(band_t& band, int beginRow, int endRow) {
+    float* depth = levels[0].depth.data();
+    if (beginRow >= endRow) return;
+    std::fill(depth + (size_t)beginRow * OCCLUSION_WIDTH, depth + (size_t)endRow * OCCLUSION_WIDTH, 1.0f);
+    if (mode != OCCLUSION_CONSERVATIVE) {
+      for (const triangle_t& t : triangles) rasterizeNearest(t, depth, beginRow, endRow);
+      return;
+    }
+
+    band.farthest.resize((size_t)(endRow - beginRow) * OCCLUSION_WIDTH);
+    band.covered.resize(band.farthest.size());
+    band.outline.resize(band.farthest.size());
+    for (const occluder_t& occluder : occluders) {
+      const int minY = std::max(occluder.minY, beginRow), maxY = std::min(occluder.maxY, endRow - 1);
+      if (minY > maxY) continue;
+      const size_t first = (size_t)(minY - beginRow) * OCCLUSION_WIDTH;
+      const size_t last = (size_t)(maxY + 1 - beginRow) * OCCLUSION_WIDTH;
+      std::fill(band.farthest.begin() + first, band.farthest.begin() + last, -INFINITY);
+      std::fill(band.covered.begin() + first, band.covered.begin() + last, 0.0f);
+      std::fill(band.outline.begin() + first, band.outline.begin() + last, 0);
+
+      for (size_t i = occluder.firstTriangle; i < occluder.endTriangle; ++i) {
+        rasterizeFarthest(triangles[i], band, beginRow, minY, maxY);
+      }
+      for (size_t i = occluder.firstSegment; i < occluder.endSegment; ++i) {
+        markOutline(segments[i], band, beginRow, minY, maxY);
+      }
+      for (size_t p = first; p < last; ++p) {
+        if (band.covered[p] == 0 || band.outline[p]) continue;
+        float& stored = depth[(size_t)beginRow * OCCLUSION_WIDTH + p];
+        stored = std::min(stored, band.farthest[p]);
+      }
+    }
+  }
+
+  // Aggressive mode: interpolated depth at the covered pixel centers.
+  static void rasterizeNearest(const triangle_t& t, float* depth, int beginRow, int endRow) {
+    const int minY = std::max(t.minY, beginRow);
+    const int maxY = std::min(t.maxY, endRow - 1);
+    for (int y = minY; y <= maxY; ++y) {
+      const float py = y - t.minY + 0.5f;
+      float rowEdge[3];
+      for (int e = 0; e < 3; ++e) rowEdge[e] = t.edges[e][1] * py + t.edges[e][2];
+      const float rowDepth = t.depth[1] * py + t.depth[2];
+      float* row = depth + (size_t)y * OCCLUSION_WIDTH;
+      int x = t.minX & ~3;
+#if OCCLUSION_SSE2
+      const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+      const __m128 zero = _mm_setzero_ps();
+      for (; x <= t.maxX; x += 4) {
+        const __m128 px = _mm_add_ps(_mm_set1_ps((float)(x - t.minX)), offsets);
+        const __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.edges[0][0]), px), _mm_set1_ps(rowEdge[0]));
+        const __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.edges[1][0]), px), _mm_set1_ps(rowEdge[1]));
+        const __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.edges[2][0]), px), _mm_set1_ps(rowEdge[2]));
+        const __m128 covered = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)),
+                                          _mm_cmpge_ps(e2, zero));
+        if (_mm_movemask_ps(covered) == 0) continue;
+        const __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.depth[0]), px), _mm_set1_ps(rowDepth));
+        const __m128 old = _mm_loadu_ps(row + x);
+        const __m128 nearest = _mm_min_ps(old, z);
+        _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(covered, nearest), _mm_andnot_ps(covered, old)));
+      }
+#else
+      for (; x <= t.maxX; ++x) {
+        const float px = x - t.minX + 0.5f;
+        if (t.edges[0][0] * px + rowEdge[0] < 0 || t.edges[1][0] * px + rowEdge[1] < 0 ||
+            t.edges[2][0] * px + rowEdge[2] < 0) {
+          continue;
+        }
+        row[x] = std::min(row[x], t.depth[0] * px + rowDepth);
+      }
+#endif
+    }
+  }
+
+  // Conservative mode: raises the farthest depth of every pixel the
+  // triangle overlaps and flags the ones holding its center.
+  static void rasterizeFarthest(const triangle_t& t, band_t& band, int beginRow, int minRow, int maxRow) {
+    const int minY = std::max(t.minY, minRow);
+    const int maxY = std::min(t.maxY, maxRow);
+    for (int y = minY; y <= maxY; ++y) {
+      const float py = y - t.minY + 0.5f;
+      float rowEdge[3];
+      for (int e = 0; e < 3; ++e) rowEdge[e] = t.edges[e][1] * py + t.edges[e][2];
+      const size_t row = (size_t)(y - beginRow) * OCCLUSION_WIDTH;
+      float* farthest = &band.farthest[row];
+      float* covered = &band.covered[row];
+      int x = t.minX;
+#if OCCLUSION_SSE2
+      // Four pixels at a time up to the last full group inside the bounds.
+      const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+      const __m128 zero = _mm_setzero_ps();
+      const __m128 depth = _mm_set1_ps(t.depth[2]);
+      for (; x + 3 <= t.maxX; x += 4) {
+        const __m128 px = _mm_add_ps(_mm_set1_ps((float)(x - t.minX)), offsets);
+        const __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.edges[0][0]), px), _mm_set1_ps(rowEdge[0]));
+        const __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.edges[1][0]), px), _mm_set1_ps(rowEdge[1]));
+        const __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.edges[2][0]), px), _mm_set1_ps(rowEdge[2]));
+        const __m128 overlaps =
+            _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(_mm_add_ps(e0, _mm_set1_ps(t.grow[0])), zero),
+                                  _mm_cmpge_ps(_mm_add_ps(e1, _mm_set1_ps(t.grow[1])), zero)),
+                       _mm_cmpge_ps(_mm_add_ps(e2, _mm_set1_ps(t.grow[2])), zero));
+        if (_mm_movemask_ps(overlaps) == 0) continue;
+        const __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)),
+                                         _mm_cmpge_ps(e2, zero));
+        const __m128 old = _mm_loadu_ps(farthest + x);
+        _mm_storeu_ps(farthest + x, _mm_or_ps(_mm_and_ps(overlaps, _mm_max_ps(old, depth)), _mm_andnot_ps(overlaps, old)));
+        _mm_storeu_ps(covered + x, _mm_or_ps(_mm_loadu_ps(covered + x), inside));
+      }
+#endif
+      for (; x <= t.maxX; ++x) {
+        const float px = x - t.minX + 0.5f;
+        const float e[3] = {t.edges[0][0] * px + rowEdge[0], t.edges[1][0] * px + rowEdge[1],
+                            t.edges[2][0] * px + rowEdge[2]};
+        if (e[0] + t.grow[0] < 0 || e[1] + t.grow[1] < 0 || e[2] + t.grow[2] < 0) continue;
+        farthest[x] = std::max(farthest[x], t.depth[2]);
+        if (e[0] >= 0 && e[1] >= 0 && e[2] >= 0) covered[x] = 1;
+      }
+    }
+  }
+
+  // Flags every pixel within the margin of the segment, row by row.
+  static void markOutline(const segment_t& s, band_t& band, int beginRow, int minRow, int maxRow) {
+    const double margin = OCCLUSION_OUTLINE_MARGIN;
+    const double* a = s.a;
+    const double* b = s.b;
+    const double minY = std::min(a[1], b[1]) - margin, maxY = std::max(a[1], b[1]) + margin;
+    const int y0 = std::max(minRow, (int)std::floor(minY)), y1 = std::min(maxRow, (int)std::floor(maxY));
+    for (int y = y0; y <= y1; ++y) {
+      // Part of the segment within the row and the margin around it.
+      double x0 = a[0], x1 = b[0];
+      if (a[1] != b[1]) {
+        const double t0 = std::clamp((std::max(y - margin, minY) - a[1]) / (b[1] - a[1]), 0.0, 1.0);
+        const double t1 = std::clamp((std::min(y + 1 + margin, maxY) - a[1]) / (b[1] - a[1]), 0.0, 1.0);
+        x0 = a[0] + (b[0] - a[0]) * t0;
+        x1 = a[0] + (b[0] - a[0]) * t1;
+      }
+      const int begin = std::max(0, (int)std::floor(std::min(x0, x1) - margin));
+      const int end = std::min(OCCLUSION_WIDTH - 1, (int)std::floor(std::max(x0, x1) + margin));
+      uint8_t* row = &band.outline[(size_t)(y - beginRow) * OCCLUSION_WIDTH];
+      for (int x = begin; x <= end; ++x) row[x] = 1;
+    }
+  }
+};
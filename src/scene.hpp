@@ -1,35 +1,197 @@
 #pragma once
 
+#include <algorithm>
+#include <memory>
 #include <vector>
 
+#include "compact_mesh.hpp"
 #include "lights.hpp"
+#include "meshlets.hpp"
 #include "models.hpp"
 
 class Scene {
  public:
-  std::vector<Object3D> models;
+  // Unique meshes, lit once per frame in object space and shared by every
+  // instance drawing them.
+  std::vector<std::shared_ptr<Object3D>> models;
+  // Grouped by model once `sortInstances` runs, so drawing binds every
+  // texture once. Each instance is still its own draw.
+  std::vector<Instance3D> instances;
   std::vector<Light3D> lights;
 
-  void applyLightingToModels() {
-    for (Object3D& model : models) {
-      for (ObjectFace3D& face : model.faces) {
-        const dVector3D surfaceNormal = face.getSurfaceNormal();
-        face.color0 = applyToSurfaceNormal(surfaceNormal);
+  // The returned instance is only valid until the next one is added.
+  Instance3D& addInstance(const std::shared_ptr<Object3D>& model) {
+    if (std::find(models.begin(), models.end(), model) == models.end()) {
+      models.push_back(model);
+    }
+    instances.push_back(Instance3D(model));
+    return instances.back();
+  }
+
+  // Call once every instance is added, sorting on every insertion is
+  // quadratic in the instance count.
+  void sortInstances() {
+    std::stable_sort(instances.begin(), instances.end(), [](const Instance3D& a, const Instance3D& b) {
+      return a.model.get() < b.model.get();
+    });
+  }
+
+  // Lighting is written to `slot` of the models' lighting results, see
+  // frame_pipeline.hpp.
+  void applyLightingToModels(size_t slot) {
+    for (const std::shared_ptr<Object3D>& model : models) {
+      for (size_t lod = 0; lod < model->getLodCount(); ++lod) {
+        if (!(model->usedLods & (1u << lod))) continue;
+        lighting_t& lighting = getLighting(*model, slot, lod);
+        if (model->isCompact()) {
+          applyLightingToCompact(*model, lod, lighting);
+          continue;
+        }
+        const faceList_t& faces = model->getFaces(lod);
+        for (const faceRange_t& range : getVisibleRanges(*model, lod, faces.size())) {
+          for (size_t f = range.begin; f < range.end; ++f) {
+            const ObjectFace3D& face = faces[f];
+            const dVector3D surfaceNormal = face.getSurfaceNormal();
+            lighting.faceColors[f] =
+                applyToSurfaceNormal(surfaceNormal) * ((face.ao0 + face.ao1 + face.ao2) / 3.0);
+          }
+        }
       }
     }
   }
 
-  void applyLightningToModelsSmooth() {
-    for (Object3D& model : models) {
-      for (ObjectFace3D& face : model.faces) {
-        face.color0 = applyGouraud(face.getVertex0Normal());
-        face.color1 = applyGouraud(face.getVertex1Normal());
-        face.color2 = applyGouraud(face.getVertex2Normal());
+  void applyLightningToModelsSmooth(size_t slot) {
+    for (const std::shared_ptr<Object3D>& model : models) {
+      for (size_t lod = 0; lod < model->getLodCount(); ++lod) {
+        if (!(model->usedLods & (1u << lod))) continue;
+        lighting_t& lighting = getLighting(*model, slot, lod);
+        if (model->isCompact()) {
+          applyLightningToCompactSmooth(*model, lod, lighting);
+          continue;
+        }
+        const faceList_t& faces = model->getFaces(lod);
+        for (const faceRange_t& range : getVisibleRanges(*model, lod, faces.size())) {
+          for (size_t f = range.begin; f < range.end; ++f) {
+            const ObjectFace3D& face = faces[f];
+            lighting.vertexColors[f * 3] = applyGouraud(face.getVertex0Normal()) * face.ao0;
+            lighting.vertexColors[f * 3 + 1] = applyGouraud(face.getVertex1Normal()) * face.ao1;
+            lighting.vertexColors[f * 3 + 2] = applyGouraud(face.getVertex2Normal()) * face.ao2;
+          }
+        }
       }
     }
   }
 
  private:
+  // Decode scratch for compact meshes, kept to avoid per frame allocations.
+  std::vector<float> decodedPositions;
+  std::vector<float> decodedNormals;
+
+  std::vector<faceRange_t> visibleRanges;
+
+  // Face ranges of the meshlets some instance sees, or the whole mesh when
+  // it has no meshlets.
+  const std::vector<faceRange_t>& getVisibleRanges(const Object3D& model, size_t lod, size_t faceCount) {
+    visibleRanges.clear();
+    if (lod >= model.meshlets.size()) {
+      visibleRanges.push_back({0, (uint32_t)faceCount, UINT32_MAX});
+      return visibleRanges;
+    }
+    const std::vector<meshlet_t>& meshlets = model.meshlets[lod];
+    for (uint32_t i = 0; i < meshlets.size(); ++i) {
+      if (!model.meshletVisible[lod][i]) continue;
+      visibleRanges.push_back({meshlets[i].firstFace, meshlets[i].firstFace + meshlets[i].faceCount, i});
+    }
+    return visibleRanges;
+  }
+
+  // Results of `lod` in `slot`, allocated on first use.
+  static lighting_t& getLighting(Object3D& model, size_t slot, size_t lod) {
+    std::vector<lighting_t>& lods = model.lighting[slot];
+    if (lods.size() != model.getLodCount()) lods.resize(model.getLodCount());
+    lighting_t& lighting = lods[lod];
+    const size_t faceCount =
+        model.isCompact() ? model.getCompact(lod).getTriangleCount() : model.getFaces(lod).size();
+    const size_t vertexCount = model.isCompact() ? model.getCompact(lod).getVertexCount() : faceCount * 3;
+    if (lighting.faceColors.size() != faceCount) lighting.faceColors.resize(faceCount);
+    if (lighting.vertexColors.size() != vertexCount) lighting.vertexColors.resize(vertexCount);
+    return lighting;
+  }
+
+  void applyLightingToCompact(const Object3D& model, size_t lod, lighting_t& lighting) {
+    const CompactMesh& mesh = model.getCompact(lod);
+    const std::vector<faceRange_t>& ranges = getVisibleRanges(model, lod, mesh.getTriangleCount());
+    decodeVisible(mesh, ranges, false);
+    const float* p = decodedPositions.data();
+    for (const faceRange_t& range : ranges) {
+      for (size_t i = range.begin; i < range.end; ++i) {
+        const uint32_t a = mesh.indices[i * 3], b = mesh.indices[i * 3 + 1], c = mesh.indices[i * 3 + 2];
+        const float* p0 = &p[a * 3];
+        const float* p1 = &p[b * 3];
+        const float* p2 = &p[c * 3];
+        const dVector3D e1(p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]);
+        const dVector3D e2(p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]);
+        const double occlusion =
+            (mesh.decodeOcclusion(a) + mesh.decodeOcclusion(b) + mesh.decodeOcclusion(c)) / 3.0;
+        lighting.faceColors[i] = applyToSurfaceNormal(~(e1 ^ e2)) * occlusion;
+      }
+    }
+  }
+
+  void applyLightningToCompactSmooth(const Object3D& model, size_t lod, lighting_t& lighting) {
+    const CompactMesh& mesh = model.getCompact(lod);
+    const std::vector<faceRange_t>& ranges = getVisibleRanges(model, lod, mesh.getTriangleCount());
+    decodeVisible(mesh, ranges, true);
+    for (const faceRange_t& range : ranges) {
+      if (range.meshlet == UINT32_MAX || mesh.meshletVertexOffsets.empty()) {
+        for (uint32_t i = 0; i < mesh.getVertexCount(); ++i) applyGouraudToCompactVertex(mesh, lighting, i);
+        return;
+      }
+      const uint32_t end = mesh.meshletVertexOffsets[range.meshlet + 1];
+      for (uint32_t k = mesh.meshletVertexOffsets[range.meshlet]; k < end; ++k) {
+        applyGouraudToCompactVertex(mesh, lighting, mesh.meshletVertices[k]);
+      }
+    }
+  }
+
+  // Decodes the vertices of the meshlets in `ranges` into the scratch
+  // arrays, entries of culled meshlets are left stale and never read. When
+  // the visible meshlets share more vertices than the mesh has, the whole
+  // mesh is decoded in order instead.
+  void decodeVisible(const CompactMesh& mesh, const std::vector<faceRange_t>& ranges, bool normals) {
+    const size_t vertexCount = mesh.getVertexCount();
+    if (decodedPositions.size() != vertexCount * 3) decodedPositions.resize(vertexCount * 3);
+    if (normals && decodedNormals.size() != vertexCount * 3) decodedNormals.resize(vertexCount * 3);
+
+    size_t visible = 0;
+    for (const faceRange_t& range : ranges) {
+      if (range.meshlet == UINT32_MAX || mesh.meshletVertexOffsets.empty()) {
+        visible = vertexCount;
+        break;
+      }
+      visible += mesh.meshletVertexOffsets[range.meshlet + 1] - mesh.meshletVertexOffsets[range.meshlet];
+    }
+    if (visible >= vertexCount) {
+      mesh.decodePositions(nullptr, vertexCount, decodedPositions.data());
+      if (normals) mesh.decodeNormals(nullptr, vertexCount, decodedNormals.data());
+      return;
+    }
+    for (const faceRange_t& range : ranges) {
+      const uint32_t* ids = &mesh.meshletVertices[mesh.meshletVertexOffsets[range.meshlet]];
+      const size_t count = mesh.meshletVertexOffsets[range.meshlet + 1] - mesh.meshletVertexOffsets[range.meshlet];
+      mesh.decodePositions(ids, count, decodedPositions.data());
+      if (normals) mesh.decodeNormals(ids, count, decodedNormals.data());
+    }
+  }
+
+  void applyGouraudToCompactVertex(const CompactMesh& mesh, lighting_t& lighting, uint32_t i) {
+    const float* p = &decodedPositions[i * 3];
+    const float* n = &decodedNormals[i * 3];
+    // Same input as `ObjectFace3D::getVertex0Normal`.
+    lighting.vertexColors[i] =
+        applyGouraud(dVector3D(p[0] + n[0], p[1] + n[1], p[2] + n[2])) * mesh.decodeOcclusion(i);
+  }
+
   ColorRGB applyGouraud(const dVector3D& surfaceNormal) const {
     const Light3D& light = lights[0];
 
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// One model of a scene file and how many instances of it are drawn.
+typedef struct {
+  std::string objPath;
+  std::string texturePath;
+  size_t instances;
+} sceneEntry_t;
+
+// Text list of the models of a scene, one per line:
+//
+//   model <obj> <tga> [instances]
+//
+// `#` starts a comment, relative paths are relative to the scene file.
+class SceneFile {
+ public:
+  static std::vector<sceneEntry_t> load(const std::string& path) {
+    std::ifstream in(path);
+    if (in.fail()) {
+      std::cout << "Error loading scene " << path << std::endl;
+      exit(1);
+    }
+    const size_t slash = path.find_last_of("/\\");
+    const std::string directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+    std::vector<sceneEntry_t> entries;
+    std::string line;
+    size_t number = 0;
+    while (std::getline(in, line)) {
+      ++number;
+      line = line.substr(0, line.find('#'));
+      std::stringstream ss(line);
+      std::string keyword;
+      if (!(ss >> keyword)) continue;
+
+      sceneEntry_t entry = {};
+      entry.instances = 1;
+      std::string count, extra;
+      if (keyword != "model" || !(ss >> entry.objPath >> entry.texturePath) ||
+          ((ss >> count) && !parseCount(count, entry.instances)) || (ss >> extra)) {
+        std::cout << "Error in scene " << path << " line " << number << ": " << line << std::endl;
+        exit(1);
+      }
+      entry.objPath = resolve(directory, entry.objPath);
+      entry.texturePath = resolve(directory, entry.texturePath);
+      entries.push_back(entry);
+    }
+    return entries;
+  }
+
+  // Paths of `entries` are written as they are.
+  static void save(const std::string& path, const std::vector<sceneEntry_t>& entries) {
+    std::ofstream out(path);
+    if (out.fail()) {
+      std::cout << "Error writing scene " << path << std::endl;
+      exit(1);
+    }
+    out << "# model <obj> <tga> [instances]" << std::endl;
+    for (const sceneEntry_t& entry : entries) {
+      out << "model " << entry.objPath << " " << entry.texturePath << " " << entry.instances << std::endl;
+    }
+  }
+
+ private:
+  // Positive decimal integers only, no sign or trailing characters.
+  static bool parseCount(const std::string& text, size_t& count) {
+    if (!isdigit((unsigned char)text[0])) return false;
+    char* end = nullptr;
+    errno = 0;
+    const unsigned long long value = strtoull(text.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE || value == 0 || value > SIZE_MAX) return false;
+    count = (size_t)value;
+    return true;
+  }
+
+  static std::string resolve(const std::string& directory, const std::string& path) {
+    const bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\' || path.find(':') != std::string::npos);
+    return absolute ? path : directory + path;
+  }
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "geom.hpp"
+#include "memory_tracker.hpp"
+
+// Faces meeting at a sharper angle than this keep separate normals.
+#define NORMALS_DEFAULT_CREASE_ANGLE 60.0
+#define NORMALS_MAX_THREADS 8
+// Smaller meshes aren't worth starting threads for.
+#define NORMALS_MIN_FACES_PER_THREAD 16384
+
+typedef enum {
+  // Large faces pull harder, cheap and fine for even tessellations.
+  NORMALS_WEIGHT_AREA,
+  // Every face counts by its angle at the corner, so splitting a face
+  // doesn't change the normal.
+  NORMALS_WEIGHT_ANGLE,
+} eNormalWeighting;
+
+// Generates smooth per corner normals for meshes loaded without `vn`.
+class SmoothNormals {
+ public:
+  // One normal for each entry of `corners`, three per face indexing
+  // `positions`: the weighted average of the normals of every face around
+  // the corner's position within `creaseAngle` degrees of its own face.
+  //
+  // Faces around a position are stored in CSR form (an offset per position
+  // into one array of corners), and face normals and corners are computed
+  // in parallel over ranges of faces. Positions with the same coordinates
+  // are welded first, so exporters splitting vertices at uv seams don't get
+  // hard edges there.
+  static trackedVector<dVector3D, MEMORY_LOADER> generate(const trackedVector<dVector3D, MEMORY_LOADER>& positions,
+                                                         const trackedVector<uint32_t, MEMORY_LOADER>& corners,
+                                                         double creaseAngle, eNormalWeighting weighting) {
+    const size_t faceCount = corners.size() / 3;
+    const trackedVector<uint32_t, MEMORY_LOADER> welded = weld(positions);
+
+    // Unit normal of every face and the weight it gives to each corner.
+    trackedVector<dVector3D, MEMORY_LOADER> faceNormals(faceCount);
+    trackedVector<double, MEMORY_LOADER> weights(corners.size());
+    parallelFor(faceCount, [&](size_t begin, size_t end) {
+      for (size_t f = begin; f < end; ++f) {
+        const dVector3D* p[3] = {&positions[corners[f * 3]], &positions[corners[f * 3 + 1]],
+                                 &positions[corners[f * 3 + 2]]};
+        const dVector3D cross = (*p[1] - *p[0]) ^ (*p[2] - *p[0]);
+        const double length = !cross;
+        faceNormals[f] = length > 0 ? dVector3D(cross * (1.0 / length)) : dVector3D(0, 0, 0);
+        for (size_t k = 0; k < 3; ++k) {
+          if (weighting == NORMALS_WEIGHT_AREA) {
+            weights[f * 3 + k] = length * 0.5;
+            continue;
+          }
+          const dVector3D a = *p[(k + 1) % 3] - *p[k];
+          const dVector3D b = *p[(k + 2) % 3] - *p[k];
+          const double lengths = !a * !b;
+          weights[f * 3 + k] = lengths > 0 ? std::acos(std::clamp((a % b) / lengths, -1.0, 1.0)) : 0;
+        }
+      }
+    });
+
+    // Corners around every welded position. Filled serially so the sums
+    // below always run in the same order.
+    trackedVector<uint32_t, MEMORY_LOADER> offsets(positions.size() + 1, 0);
+    for (uint32_t v : corners) offsets[welded[v] + 1]++;
+    for (size_t i = 0; i < positions.size(); ++i) offsets[i + 1] += offsets[i];
+    trackedVector<uint32_t, MEMORY_LOADER> adjacency(corners.size());
+    {
+      trackedVector<uint32_t, MEMORY_LOADER> fill(offsets.begin(), offsets.end() - 1);
+      for (size_t c = 0; c < corners.size(); ++c) adjacency[fill[welded[corners[c]]]++] = (uint32_t)c;
+    }
+
+    const double cosine = std::cos(creaseAngle * PI / 180.0);
+    trackedVector<dVector3D, MEMORY_LOADER> normals(corners.size());
+    parallelFor(faceCount, [&](size_t begin, size_t end) {
+      for (size_t c = begin * 3; c < end * 3; ++c) {
+        const dVector3D& own = faceNormals[c / 3];
+        const uint32_t v = welded[corners[c]];
+        dVector3D sum(0, 0, 0);
+        for (uint32_t a = offsets[v]; a < offsets[v + 1]; ++a) {
+          const dVector3D& other = faceNormals[adjacency[a] / 3];
+          if ((other % own) >= cosine) sum = sum + other * weights[adjacency[a]];
+        }
+        const double length = !sum;
+        normals[c] = length > 0 ? dVector3D(sum * (1.0 / length)) : own;
+      }
+    });
+    return normals;
+  }
+
+ private:
+  static uint64_t hashPosition(const dVector3D& p) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < 3; ++i) {
+      // +0.0 and -0.0 are the same position.
+      const double value = p[i] == 0 ? 0.0 : p[i];
+      uint64_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      hash = (hash ^ bits ^ (bits >> 29)) * 1099511628211ull;
+    }
+    return hash ^ (hash >> 32);
+  }
+
+  // For every position, the first one with the same coordinates. Open
+  // addressing over a flat table, a node based map is several times slower
+  // on millions of positions.
+  static trackedVector<uint32_t, MEMORY_LOADER> weld(const trackedVector<dVector3D, MEMORY_LOADER>& positions) {
+    size_t capacity = 16;
+    while (capacity < positions.size() * 2) capacity *= 2;
+    trackedVector<uint32_t, MEMORY_LOADER> table(capacity, UINT32_MAX);
+    trackedVector<uint32_t, MEMORY_LOADER> welded(positions.size());
+    for (uint32_t i = 0; i < positions.size(); ++i) {
+      const dVector3D& p = positions[i];
+      size_t slot = hashPosition(p) & (capacity - 1);
+      while (table[slot] != UINT32_MAX) {
+        const dVector3D& other = positions[table[slot]];
+        if (other[0] == p[0] && other[1] == p[1] && other[2] == p[2]) break;
+        slot = (slot + 1) & (capacity - 1);
+      }
+      if (table[slot] == UINT32_MAX) table[slot] = i;
+      welded[i] = table[slot];
+    }
+    return welded;
+  }
+
+  // Runs `job(begin, end)` over ranges of `count` faces on up to
+  // NORMALS_MAX_THREADS threads.
+  template <typename Job>
+  static void parallelFor(size_t count, Job job) {
+    const size_t threads =
+        std::min({(size_t)NORMALS_MAX_THREADS, (size_t)std::max(1u, std::thread::hardware_concurrency()),
+                  std::max<size_t>(1, count / NORMALS_MIN_FACES_PER_THREAD)});
+    if (threads == 1) {
+      job(0, count);
+      return;
+    }
+    std::vector<std::future<void>> jobs;
+    for (size_t t = 0; t < threads; ++t) {
+      const size_t begin = count * t / threads;
+      const size_t end = count * (t + 1) / threads;
+      jobs.push_back(std::async(std::launch::async, [&job, begin, end]() { job(begin, end); }));
+    }
+    for (std::future<void>& pending : jobs) pending.get();
+  }
+};
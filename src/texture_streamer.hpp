@@ -0,0 +1,319 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "fileparsers/tga.hpp"
+#include "memory_tracker.hpp"
+#include "models.hpp"
+#include "scene.hpp"
+
+// GL 1.2, missing from GL 1.1 headers.
+#ifndef GL_TEXTURE_BASE_LEVEL
+#define GL_TEXTURE_BASE_LEVEL 0x813C
+#endif
+#ifndef GL_TEXTURE_MAX_LEVEL
+#define GL_TEXTURE_MAX_LEVEL 0x813D
+#endif
+
+// Resident bytes of uploaded mip levels when `--texture-budget` isn't given.
+#define TEXTURE_STREAM_DEFAULT_BUDGET_MB 64
+// Levels this size and smaller are loaded first, regardless of the budget,
+// and never evicted so every texture can be drawn from the start.
+#define TEXTURE_STREAM_BASE_SIZE 64
+// Decodes running at once, each one holds a whole decoded image.
+#define TEXTURE_STREAM_MAX_DECODES 2
+
+typedef trackedVector<uint8_t, MEMORY_TEXTURES> pixels_t;
+
+// Levels [first, first + levels.size()) of a texture, decoded off the GL
+// thread.
+typedef struct {
+  size_t first;
+  std::vector<pixels_t> levels;
+} decodedMips_t;
+
+typedef struct {
+  Texture2D* texture;
+  // Finest level uploaded, `levelCount` when there is none yet.
+  size_t resident;
+  size_t levelCount;
+  size_t baseLevel;
+  // Coverage of the current frame, decides who gets evicted.
+  double coverage;
+  // Valid while levels above `resident` are being decoded.
+  std::future<decodedMips_t> decode;
+} streamedTexture_t;
+
+// Keeps the mip levels of every texture that its instances need on screen
+// resident on GL, within a byte budget.
+//
+// Levels are uploaded into a single GL texture with their real level number
+// and GL_TEXTURE_BASE_LEVEL points at the finest one resident, so refining
+// or evicting a texture never copies the levels it keeps. TGA files have no
+// mips, so every decode reads the whole image and box filters it down to the
+// levels it was asked for.
+//
+// The update thread turns projected sizes into `requestLevels`, the GL thread
+// calls `update` every frame to upload finished decodes, start new ones for
+// the most covered textures and evict the least covered ones when a texture
+// doesn't fit.
+class TextureStreamer {
+ public:
+  size_t budgetBytes = (size_t)TEXTURE_STREAM_DEFAULT_BUDGET_MB << 20;
+
+  ~TextureStreamer() { stop(); }
+
+  // Creates the GL texture of `texture`, nothing is resident until `update`.
+  void add(Texture2D& texture) {
+    GLuint ref = 0;
+    glGenTextures(1, &ref);
+    glBindTexture(GL_TEXTURE_2D, ref);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    texture.textureRef = ref;
+
+    streamedTexture_t entry;
+    entry.texture = &texture;
+    entry.levelCount = getLevelCount(texture);
+    entry.resident = entry.levelCount;
+    entry.baseLevel = getBaseLevel(texture);
+    entry.coverage = 0;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)entry.levelCount - 1);
+    textures.push_back(std::move(entry));
+  }
+
+  // Update thread: the finest level every texture needs in the frame of
+  // `slot`, from the projected size of its visible instances. A texture is
+  // assumed to cover its model once, so a level is needed when it still
+  // has more texels than the model has pixels across.
+  static void requestLevels(Scene& scene, size_t slot) {
+    for (const std::shared_ptr<Object3D>& model : scene.models) {
+      Texture2D& texture = model->texture;
+      texture.requests[slot] = {getBaseLevel(texture), 0};
+    }
+    for (const Instance3D& instance : scene.instances) {
+      const Object3D& model = *instance.model;
+      const instanceFrame_t& frame = instance.frames[slot];
+      if (frame.lod < model.meshlets.size() && frame.visibleMeshlets.empty()) continue;
+      Texture2D& texture = instance.model->texture;
+      textureRequest_t& request = texture.requests[slot];
+      request.level = std::min(request.level, getWantedLevel(texture, frame.diameter));
+      request.coverage = std::max(request.coverage, frame.diameter);
+    }
+  }
+
+  // GL thread, before drawing the frame of `slot`.
+  void update(size_t slot) {
+    for (streamedTexture_t& entry : textures) {
+      if (entry.decode.valid() &&
+          entry.decode.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        upload(entry, entry.decode.get());
+        decoding--;
+      }
+      entry.coverage = entry.texture->requests[slot].coverage;
+    }
+
+    std::vector<streamedTexture_t*> order;
+    for (streamedTexture_t& entry : textures) order.push_back(&entry);
+    std::stable_sort(order.begin(), order.end(), [](const streamedTexture_t* a, const streamedTexture_t* b) {
+      return a->coverage > b->coverage;
+    });
+
+    for (streamedTexture_t* entry : order) {
+      if (decoding >= TEXTURE_STREAM_MAX_DECODES) break;
+      if (entry->decode.valid()) continue;
+      // The base levels are always wanted, even off screen, and load on
+      // their own first so the texture is drawn before the finer levels of
+      // the same image are decoded by a later update.
+      size_t wanted = std::min(entry->texture->requests[slot].level, entry->baseLevel);
+      if (entry->resident == entry->levelCount) wanted = entry->baseLevel;
+      size_t target = wanted;
+      while (target < entry->resident && !reserve(*entry, target)) target++;
+      if (target >= entry->resident) continue;
+
+      const std::string path = entry->texture->path;
+      const size_t last = entry->resident;
+      entry->decode = std::async(std::launch::async, [path, target, last]() { return decode(path, target, last); });
+      decoding++;
+    }
+  }
+
+  // Waits for the running decodes and drops their results.
+  void stop() {
+    for (streamedTexture_t& entry : textures) {
+      if (entry.decode.valid()) entry.decode.get();
+    }
+    decoding = 0;
+    pendingBytes = 0;
+  }
+
+  // GL thread.
+  void printStats(std::ostream& out) const {
+    out << "Textures: " << residentBytes << " of " << budgetBytes << " bytes resident, " << decoding
+        << " decoding, " << uploads << " uploads, " << evictions << " evictions" << std::endl;
+    for (const streamedTexture_t& entry : textures) {
+      const Texture2D& texture = *entry.texture;
+      out << "  " << texture.path << ": level " << entry.resident << " of " << entry.levelCount << " ("
+          << getLevelSize(texture.width, entry.resident) << " x " << getLevelSize(texture.height, entry.resident)
+          << "), coverage " << entry.coverage << " px" << std::endl;
+    }
+  }
+
+  // Level 0 is the full image, the last level is 1x1.
+  static size_t getLevelCount(const Texture2D& texture) {
+    size_t count = 1;
+    while ((std::max(texture.width, texture.height) >> count) > 0) count++;
+    return count;
+  }
+
+  static size_t getBaseLevel(const Texture2D& texture) {
+    size_t level = 0;
+    while ((std::max(texture.width, texture.height) >> level) > TEXTURE_STREAM_BASE_SIZE) level++;
+    return level;
+  }
+
+  static size_t getWantedLevel(const Texture2D& texture, double diameter) {
+    const double size = (double)std::max(texture.width, texture.height);
+    const size_t base = getBaseLevel(texture);
+    if (diameter >= size) return 0;
+    if (diameter <= 1) return base;
+    return std::min(base, (size_t)std::log2(size / diameter));
+  }
+
+ private:
+  std::vector<streamedTexture_t> textures;
+  size_t residentBytes = 0;
+  // Bytes of the decodes in flight, counted against the budget from the
+  // moment they start.
+  size_t pendingBytes = 0;
+  size_t decoding = 0;
+  size_t uploads = 0;
+  size_t evictions = 0;
+
+  static size_t getLevelSize(size_t size, size_t level) { return std::max<size_t>(1, size >> level); }
+
+  static size_t getLevelBytes(const Texture2D& texture, size_t level) {
+    return getLevelSize(texture.width, level) * getLevelSize(texture.height, level) * texture.channels;
+  }
+
+  static size_t getBytes(const Texture2D& texture, size_t first, size_t last) {
+    size_t bytes = 0;
+    for (size_t level = first; level < last; ++level) bytes += getLevelBytes(texture, level);
+    return bytes;
+  }
+
+  // Makes room for levels [target, resident) of `entry`, evicting levels of
+  // less covered textures, one level at a time starting from the least
+  // covered one. Nothing is evicted unless it frees enough.
+  bool reserve(const streamedTexture_t& entry, size_t target) {
+    const size_t need = getBytes(*entry.texture, target, entry.resident);
+    if (target < entry.baseLevel) {
+      size_t evictable = 0;
+      for (const streamedTexture_t& other : textures) {
+        if (isEvictableFor(other, entry)) evictable += getBytes(*other.texture, other.resident, other.baseLevel);
+      }
+      if (residentBytes + pendingBytes + need > budgetBytes + evictable) return false;
+
+      while (residentBytes + pendingBytes + need > budgetBytes) {
+        streamedTexture_t* victim = nullptr;
+        for (streamedTexture_t& other : textures) {
+          if (isEvictableFor(other, entry) && (!victim || other.coverage < victim->coverage)) victim = &other;
+        }
+        evictLevel(*victim);
+      }
+    }
+    pendingBytes += need;
+    return true;
+  }
+
+  static bool isEvictableFor(const streamedTexture_t& other, const streamedTexture_t& entry) {
+    return &other != &entry && other.coverage < entry.coverage && other.resident < other.baseLevel &&
+           !other.decode.valid();
+  }
+
+  void evictLevel(streamedTexture_t& entry) {
+    const Texture2D& texture = *entry.texture;
+    const size_t level = entry.resident++;
+    glBindTexture(GL_TEXTURE_2D, texture.textureRef);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, (GLint)entry.resident);
+    // A zero sized image releases the storage of the level.
+    const GLenum format = texture.channels == 4 ? GL_RGBA : GL_RGB;
+    glTexImage2D(GL_TEXTURE_2D, (GLint)level, format, 0, 0, 0, format, GL_UNSIGNED_BYTE, nullptr);
+    residentBytes -= getLevelBytes(texture, level);
+    evictions++;
+  }
+
+  void upload(streamedTexture_t& entry, decodedMips_t mips) {
+    const Texture2D& texture = *entry.texture;
+    const GLenum format = texture.channels == 4 ? GL_RGBA : GL_RGB;
+    glBindTexture(GL_TEXTURE_2D, texture.textureRef);
+    // Small levels have rows that aren't 4 byte aligned.
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (size_t i = 0; i < mips.levels.size(); ++i) {
+      const size_t level = mips.first + i;
+      glTexImage2D(GL_TEXTURE_2D, (GLint)level, format, (GLsizei)getLevelSize(texture.width, level),
+                   (GLsizei)getLevelSize(texture.height, level), 0, format, GL_UNSIGNED_BYTE,
+                   mips.levels[i].data());
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    const size_t bytes = getBytes(texture, mips.first, entry.resident);
+    pendingBytes -= bytes;
+    residentBytes += bytes;
+    entry.resident = mips.first;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, (GLint)entry.resident);
+    uploads++;
+  }
+
+  // Background thread: decodes `path` and returns levels [first, last).
+  static decodedMips_t decode(const std::string& path, size_t first, size_t last) {
+    Tga file(path.c_str());
+    size_t width = file.GetWidth();
+    size_t height = file.GetHeight();
+    const size_t channels = file.HasAlphaChannel() ? 4 : 3;
+    pixels_t level = file.TakePixels();
+
+    decodedMips_t mips;
+    mips.first = first;
+    for (size_t i = 0; i < last; ++i) {
+      pixels_t next;
+      if (i + 1 < last) next = downsample(level, width, height, channels);
+      if (i >= first) mips.levels.push_back(std::move(level));
+      level = std::move(next);
+      width = getLevelSize(width, 1);
+      height = getLevelSize(height, 1);
+    }
+    return mips;
+  }
+
+  // 2x2 box filter, odd sizes repeat their last row or column.
+  static pixels_t downsample(const pixels_t& source, size_t width, size_t height, size_t channels) {
+    const size_t w = getLevelSize(width, 1);
+    const size_t h = getLevelSize(height, 1);
+    pixels_t result(w * h * channels);
+    for (size_t y = 0; y < h; ++y) {
+      const size_t y0 = std::min(y * 2, height - 1) * width;
+      const size_t y1 = std::min(y * 2 + 1, height - 1) * width;
+      for (size_t x = 0; x < w; ++x) {
+        const size_t x0 = std::min(x * 2, width - 1);
+        const size_t x1 = std::min(x * 2 + 1, width - 1);
+        for (size_t c = 0; c < channels; ++c) {
+          const unsigned sum = source[(y0 + x0) * channels + c] + source[(y0 + x1) * channels + c] +
+                               source[(y1 + x0) * channels + c] + source[(y1 + x1) * channels + c];
+          result[(y * w + x) * channels + c] = (uint8_t)((sum + 2) / 4);
+        }
+      }
+    }
+    return result;
+  }
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <fstream>
 #include <iostream>
@@ -9,35 +10,46 @@
 #include <vector>
 #include <stdint.h>
 #include <memory>
+#include <stdlib.h>
 
 #include "models.hpp"
 #include "geom.hpp"
 #include "fileparsers/tga.hpp"
+#include "smooth_normals.hpp"
 
 #define ALLOW_WAVEFRONT_FILE_PARSING_DEBUG_LOGS false
 #define ALLOW_WAVEFRONT_FACES_PARSING_DEBUG_LOGS false
 #define ALLOW_WAVEFRONT_LOADING_TEXTURE_DEBUG_LOGS false
 
 class WavefrontObjLoader {
+  // 0 based indices, -1 when the face has no uv or normal.
   typedef struct {
-    std::vector<int> vertices;
-    std::vector<int> textureVertices;
-    std::vector<int> normalVertices;
+    int vertices[3];
+    int textureVertices[3];
+    int normalVertices[3];
   } rawFace_t;
  public:
-  static Object3D loadObjWavefrontObj(const std::string filename, const std::string texturePath) {
-    Object3D model = WavefrontObjLoader::loadObjWavefrontObj(filename);
+  static Object3D loadObjWavefrontObj(const std::string filename, const std::string texturePath,
+                                      double creaseAngle = NORMALS_DEFAULT_CREASE_ANGLE,
+                                      eNormalWeighting weighting = NORMALS_WEIGHT_ANGLE) {
+    Object3D model = WavefrontObjLoader::loadObjWavefrontObj(filename, creaseAngle, weighting);
     model.texture = WavefrontObjLoader::loadTexture(texturePath);
     return model;
   }
 
-  static Object3D loadObjWavefrontObj(const std::string filename) {
+  // Faces without normals get smooth ones, split where faces meet at more
+  // than `creaseAngle` degrees and averaged by `weighting`. Faces without
+  // uvs get (0, 0).
+  static Object3D loadObjWavefrontObj(const std::string filename,
+                                      double creaseAngle = NORMALS_DEFAULT_CREASE_ANGLE,
+                                      eNormalWeighting weighting = NORMALS_WEIGHT_ANGLE) {
     Object3D model;
+    model.name = filename;
 
-    std::vector<dVector3D> vertices;
-    std::vector<dVector3D> textureVectices;
-    std::vector<dVector3D> normalVectices;
-    std::vector<rawFace_t> faces;
+    trackedVector<dVector3D, MEMORY_LOADER> vertices;
+    trackedVector<dVector3D, MEMORY_LOADER> textureVectices;
+    trackedVector<dVector3D, MEMORY_LOADER> normalVectices;
+    trackedVector<rawFace_t, MEMORY_LOADER> faces;
 
     std::ifstream in;
     std::cout << "Loading wavefront obj path: " << filename << std::endl;
@@ -48,8 +60,10 @@ class WavefrontObjLoader {
     }
 
     std::string line;
+    size_t number = 0;
     while (!in.eof()) {
       std::getline(in, line);
+      ++number;
       bool is3DPoint = line.compare(0, 2, "v ") == 0;
       bool isTexture = line.compare(0, 3, "vt ") == 0;
       bool isNormal = line.compare(0, 3, "vn ") == 0;
@@ -77,7 +91,13 @@ class WavefrontObjLoader {
                   << std::endl;
 #endif
       } else if (isFace) {
-        rawFace_t face = WavefrontObjLoader::parseFace(line);
+        rawFace_t face;
+        const size_t counts[3] = {vertices.size(), textureVectices.size(), normalVectices.size()};
+        if (!WavefrontObjLoader::parseFace(line, counts, face)) {
+          std::cout << "Error loading wavefront object " << filename << " line " << number << ": " << line
+                    << std::endl;
+          exit(1);
+        }
         faces.push_back(face);
 #if ALLOW_WAVEFRONT_FILE_PARSING_DEBUG_LOGS
         std::cout << "f " << face.vertices[0] << " " << face.vertices[1] << " " << face.vertices[2]
@@ -89,6 +109,9 @@ class WavefrontObjLoader {
     }
 
 
+    const trackedVector<dVector3D, MEMORY_LOADER> generatedNormals =
+        WavefrontObjLoader::generateMissingNormals(vertices, faces, creaseAngle, weighting);
+
     model.faces.reserve(faces.size());
     for (size_t i = 0; i < faces.size(); i++) {
       ObjectFace3D face;
@@ -96,13 +119,14 @@ class WavefrontObjLoader {
       face.p1 = vertices[faces[i].vertices[1]];
       face.p2 = vertices[faces[i].vertices[2]];
 
-      face.t0 = textureVectices[faces[i].textureVertices[0]];
-      face.t1 = textureVectices[faces[i].textureVertices[1]];
-      face.t2 = textureVectices[faces[i].textureVertices[2]];
-
-      face.p0n = normalVectices[faces[i].normalVertices[0]];
-      face.p1n = normalVectices[faces[i].normalVertices[1]];
-      face.p2n = normalVectices[faces[i].normalVertices[2]];
+      dVector3D* uvs[3] = {&face.t0, &face.t1, &face.t2};
+      dVector3D* normals[3] = {&face.p0n, &face.p1n, &face.p2n};
+      for (size_t k = 0; k < 3; ++k) {
+        const int t = faces[i].textureVertices[k];
+        *uvs[k] = t >= 0 ? textureVectices[t] : dVector3D(0, 0, 0);
+        const int n = faces[i].normalVertices[k];
+        *normals[k] = n >= 0 ? normalVectices[n] : generatedNormals[i * 3 + k];
+      }
       model.faces.push_back(face);
 
 #if ALLOW_WAVEFRONT_FACES_PARSING_DEBUG_LOGS
@@ -110,6 +134,8 @@ class WavefrontObjLoader {
 #endif
     }
 
+    model.computeBounds();
+
 #if ALLOW_WAVEFRONT_FILE_PARSING_DEBUG_LOGS
     std::cout << "total faces: " << model.faces.size() << std::endl;
 #endif
@@ -119,7 +145,7 @@ class WavefrontObjLoader {
 
  private:
   static dVector3D parseVectorLine(const std::string& line) {
-    dVector3D point;
+    dVector3D point(0, 0, 0);
     std::stringstream ss;
     ss.str(line.c_str());
     std::string trash;
@@ -128,12 +154,12 @@ class WavefrontObjLoader {
     return point;
   }
 
-  static rawFace_t parseFace(const std::string& line) {
+  // Accepts `v`, `v/vt`, `v//vn` and `v/vt/vn` corners. `counts` are the
+  // positions, uvs and normals read so far, negative indices count back
+  // from them. False when a corner has no position or an index is out of
+  // range or not a number.
+  static bool parseFace(const std::string& line, const size_t counts[3], rawFace_t& face) {
     const char* s = line.c_str();
-    rawFace_t face;
-    face.vertices.reserve(3);
-    face.textureVertices.reserve(3);
-    face.normalVertices.reserve(3);
 
     std::stringstream ss;
     ss.str(s);
@@ -142,36 +168,72 @@ class WavefrontObjLoader {
     // Remove initial trash characters.
     ss >> f;
     for (size_t i = 0; i < 3; i++) {
-      ss >> f;
-      const size_t c = f.find('/');
-      // Parse the index (starts with 0 so remove 1)
-      const std::string p = f.substr(0, c);
-      const int vertex_index = std::atoi(p.c_str()) - 1;
-      face.vertices.push_back(vertex_index);
-
-      const size_t c2 = f.find('/', c + 1);
-      const std::string p2 = f.substr(c + 1, ((c2 - 1) - c));
-      const int texture_vertex = std::atoi(p2.c_str()) - 1;
-      face.textureVertices.push_back(texture_vertex);
-
-      const size_t c3 = f.find('/', c2 + 1);
-      const std::string p3 = f.substr(c2 + 1, ((c3 - 1) - c2));
-      const int normalVertices = std::atoi(p3.c_str()) - 1;
-      face.normalVertices.push_back(normalVertices);
+      f.clear();
+      if (!(ss >> f)) return false;
+      int* indices[3] = {&face.vertices[i], &face.textureVertices[i], &face.normalVertices[i]};
+      size_t begin = 0;
+      for (size_t field = 0; field < 3; ++field) {
+        // Indices start with 1, missing or empty uv and normal fields
+        // become -1.
+        *indices[field] = -1;
+        if (begin > f.size()) continue;
+        const size_t end = std::min(f.find('/', begin), f.size());
+        if (end > begin && !parseIndex(f.substr(begin, end - begin), counts[field], *indices[field])) return false;
+        begin = end + 1;
+      }
+      if (face.vertices[i] < 0) return false;
+    }
+
+    return true;
+  }
+
+  static bool parseIndex(const std::string& text, size_t count, int& index) {
+    char* end = nullptr;
+    const long value = std::strtol(text.c_str(), &end, 10);
+    if (*end != '\0' || value == 0) return false;
+    const long resolved = value > 0 ? value - 1 : (long)count + value;
+    if (resolved < 0 || resolved >= (long)count) return false;
+    index = (int)resolved;
+    return true;
+  }
+
+  // Normals of every corner of `faces` that has none (see smooth_normals.hpp),
+  // empty when all of them have.
+  static trackedVector<dVector3D, MEMORY_LOADER> generateMissingNormals(
+      const trackedVector<dVector3D, MEMORY_LOADER>& vertices, const trackedVector<rawFace_t, MEMORY_LOADER>& faces,
+      double creaseAngle, eNormalWeighting weighting) {
+    size_t missing = 0;
+    for (const rawFace_t& face : faces) {
+      for (size_t k = 0; k < 3; ++k) missing += face.normalVertices[k] < 0;
     }
+    if (missing == 0) return {};
 
-    return face;
+    const auto start = std::chrono::steady_clock::now();
+    trackedVector<uint32_t, MEMORY_LOADER> corners(faces.size() * 3);
+    for (size_t i = 0; i < faces.size(); ++i) {
+      for (size_t k = 0; k < 3; ++k) corners[i * 3 + k] = (uint32_t)faces[i].vertices[k];
+    }
+    trackedVector<dVector3D, MEMORY_LOADER> normals =
+        SmoothNormals::generate(vertices, corners, creaseAngle, weighting);
+    std::cout << "Normals: generated for " << missing << " corners, crease " << creaseAngle << " degrees, "
+              << (weighting == NORMALS_WEIGHT_AREA ? "area" : "angle") << " weighted, "
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+              << " ms" << std::endl;
+    return normals;
   }
 
+  // Only the header is read, pixels are decoded when the texture streamer
+  // needs them.
   static Texture2D loadTexture(const std::string& path) {
 #if ALLOW_WAVEFRONT_LOADING_TEXTURE_DEBUG_LOGS
     std::cout << "loading texture... " << path.c_str() << std::endl;
 #endif
 
-    Tga file(path.c_str());
+    std::uint32_t width, height, bitsPerPixel;
+    Tga::ReadHeader(path.c_str(), width, height, bitsPerPixel);
 #if ALLOW_WAVEFRONT_LOADING_TEXTURE_DEBUG_LOGS
-    std::cout << "texture loaded: " << file.GetWidth() << " x " << file.GetHeight() << " size " << file.GetPixels().size() << " bytes, alpha? " << file.HasAlphaChannel() << std::endl;
+    std::cout << "texture found: " << width << " x " << height << " alpha? " << (bitsPerPixel == 32) << std::endl;
 #endif
-    return Texture2D(file.GetWidth(), file.GetHeight(), file.GetPixels());
+    return Texture2D(path, width, height, bitsPerPixel / 8);
   }
 };
@@ -0,0 +1,297 @@
+// Writes procedural OBJ meshes, TGA textures and scene files of any size, so
+// loading, lighting and drawing can be measured across data sizes.
+//
+//   wavefront_generator sphere <triangles> <out.obj> [--no-uv] [--no-normals]
+//   wavefront_generator terrain <triangles> <out.obj> [--no-uv] [--no-normals] [--seed N]
+//   wavefront_generator texture <size> <out.tga> [--raw] [--seed N]
+//   wavefront_generator scene <directory> <models> <triangles> [--instances N]
+//       [--texture-size N] [--raw] [--no-uv] [--no-normals] [--seed N]
+//
+// Scenes alternate spheres and terrains, each with its own texture, and are
+// drawn with `wavefront_renderer --scene <directory>/scene.txt`.
+#include <stdint.h>
+#include <stdio.h>
+
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "fileparsers/tga.hpp"
+#include "geom.hpp"
+#include "scene_file.hpp"
+
+#define GENERATOR_TERRAIN_OCTAVES 6
+#define GENERATOR_TERRAIN_HEIGHT 0.25
+#define GENERATOR_TEXTURE_CELLS 16
+#define GENERATOR_WRITE_BUFFER (1 << 20)
+
+typedef struct {
+  bool uvs;
+  bool normals;
+  bool raw;
+  uint32_t seed;
+  size_t instances;
+  size_t textureSize;
+} generatorOptions_t;
+
+// Position and normal of grid `grid` at (u, v) in [0, 1]. Grids are written
+// with u x v facing out so their triangles are counter clockwise.
+typedef std::function<void(size_t grid, double u, double v, dVector3D& position, dVector3D& normal)> surface_t;
+
+static double hashNoise(int32_t x, int32_t z, uint32_t seed) {
+  uint32_t h = (uint32_t)x * 374761393u + (uint32_t)z * 668265263u + seed * 2246822519u;
+  h = (h ^ (h >> 13)) * 1274126177u;
+  h ^= h >> 16;
+  return h / 4294967295.0;
+}
+
+// Bilinear value noise in [0, 1].
+static double valueNoise(double x, double z, uint32_t seed) {
+  const double fx = std::floor(x);
+  const double fz = std::floor(z);
+  const int32_t ix = (int32_t)fx;
+  const int32_t iz = (int32_t)fz;
+  double tx = x - fx;
+  double tz = z - fz;
+  tx = tx * tx * (3 - 2 * tx);
+  tz = tz * tz * (3 - 2 * tz);
+  const double a = hashNoise(ix, iz, seed) + (hashNoise(ix + 1, iz, seed) - hashNoise(ix, iz, seed)) * tx;
+  const double b =
+      hashNoise(ix, iz + 1, seed) + (hashNoise(ix + 1, iz + 1, seed) - hashNoise(ix, iz + 1, seed)) * tx;
+  return a + (b - a) * tz;
+}
+
+static double terrainHeight(double x, double z, uint32_t seed) {
+  double height = 0;
+  double amplitude = 0.5;
+  double frequency = 2;
+  for (int octave = 0; octave < GENERATOR_TERRAIN_OCTAVES; ++octave) {
+    height += (valueNoise(x * frequency, z * frequency, seed + octave) - 0.5) * amplitude;
+    amplitude *= 0.5;
+    frequency *= 2;
+  }
+  return height * GENERATOR_TERRAIN_HEIGHT * 2;
+}
+
+// Streams `grids` grids of `n` x `n` quads to `path` without keeping them in
+// memory, so the triangle count is only limited by the disk. Returns the
+// number of triangles.
+static size_t writeGrids(const std::string& path, size_t grids, size_t n, const surface_t& surface,
+                         const generatorOptions_t& options) {
+  FILE* out = fopen(path.c_str(), "w");
+  if (!out) {
+    std::cout << "Can't write " << path << std::endl;
+    exit(1);
+  }
+  std::vector<char> buffer(GENERATOR_WRITE_BUFFER);
+  setvbuf(out, buffer.data(), _IOFBF, buffer.size());
+
+  // Grids are laid side by side in uv space, 3 per row.
+  const size_t columns = std::min<size_t>(grids, 3);
+  const size_t rows = (grids + columns - 1) / columns;
+  auto forEachVertex = [&](const std::function<void(size_t grid, size_t i, size_t j)>& visit) {
+    for (size_t grid = 0; grid < grids; ++grid) {
+      for (size_t j = 0; j <= n; ++j) {
+        for (size_t i = 0; i <= n; ++i) visit(grid, i, j);
+      }
+    }
+  };
+
+  fprintf(out, "# %zu grids of %zu x %zu quads\n", grids, n, n);
+  dVector3D position, normal;
+  forEachVertex([&](size_t grid, size_t i, size_t j) {
+    surface(grid, (double)i / n, (double)j / n, position, normal);
+    fprintf(out, "v %.6f %.6f %.6f\n", position.x(), position.y(), position.z());
+  });
+  if (options.uvs) {
+    forEachVertex([&](size_t grid, size_t i, size_t j) {
+      fprintf(out, "vt %.6f %.6f 0.0\n", (grid % columns + (double)i / n) / columns,
+              (grid / columns + (double)j / n) / rows);
+    });
+  }
+  if (options.normals) {
+    forEachVertex([&](size_t grid, size_t i, size_t j) {
+      surface(grid, (double)i / n, (double)j / n, position, normal);
+      fprintf(out, "vn %.6f %.6f %.6f\n", normal.x(), normal.y(), normal.z());
+    });
+  }
+
+  // Positions, uvs and normals share their index.
+  auto writeCorner = [&](size_t index) {
+    if (options.uvs && options.normals) {
+      fprintf(out, " %zu/%zu/%zu", index, index, index);
+    } else if (options.uvs) {
+      fprintf(out, " %zu/%zu", index, index);
+    } else if (options.normals) {
+      fprintf(out, " %zu//%zu", index, index);
+    } else {
+      fprintf(out, " %zu", index);
+    }
+  };
+  const size_t stride = n + 1;
+  for (size_t grid = 0; grid < grids; ++grid) {
+    const size_t first = grid * stride * stride + 1;
+    for (size_t j = 0; j < n; ++j) {
+      for (size_t i = 0; i < n; ++i) {
+        const size_t a = first + j * stride + i;
+        const size_t b = a + 1;
+        const size_t c = a + stride + 1;
+        const size_t d = a + stride;
+        fputs("f", out);
+        writeCorner(a);
+        writeCorner(b);
+        writeCorner(c);
+        fputs("\nf", out);
+        writeCorner(a);
+        writeCorner(c);
+        writeCorner(d);
+        fputs("\n", out);
+      }
+    }
+  }
+  const long bytes = ftell(out);
+  fclose(out);
+
+  const size_t triangles = grids * n * n * 2;
+  std::cout << "wrote " << path << ": " << triangles << " triangles, " << grids * stride * stride
+            << " vertices, " << bytes << " bytes" << std::endl;
+  return triangles;
+}
+
+// Unit sphere made of the 6 faces of a subdivided cube, 12 n^2 triangles.
+static void writeSphere(const std::string& path, size_t triangles, const generatorOptions_t& options) {
+  const size_t n = std::max<size_t>(1, (size_t)std::llround(std::sqrt(triangles / 12.0)));
+  // Face normal and u axis, v is normal x u.
+  static const double faces[6][2][3] = {
+      {{1, 0, 0}, {0, 1, 0}}, {{-1, 0, 0}, {0, 1, 0}}, {{0, 1, 0}, {0, 0, 1}},
+      {{0, -1, 0}, {0, 0, 1}}, {{0, 0, 1}, {1, 0, 0}}, {{0, 0, -1}, {1, 0, 0}},
+  };
+  writeGrids(path, 6, n,
+             [](size_t grid, double u, double v, dVector3D& position, dVector3D& normal) {
+               const dVector3D axis(faces[grid][0][0], faces[grid][0][1], faces[grid][0][2]);
+               const dVector3D uAxis(faces[grid][1][0], faces[grid][1][1], faces[grid][1][2]);
+               const dVector3D vAxis = axis ^ uAxis;
+               normal = ~(axis + uAxis * (2 * u - 1) + vAxis * (2 * v - 1));
+               position = normal;
+             },
+             options);
+}
+
+// Noisy height field over [-1, 1] in x and z, 2 n^2 triangles.
+static void writeTerrain(const std::string& path, size_t triangles, const generatorOptions_t& options) {
+  const size_t n = std::max<size_t>(1, (size_t)std::llround(std::sqrt(triangles / 2.0)));
+  const uint32_t seed = options.seed;
+  // Normals come from the noise itself, the exact spacing doesn't matter.
+  const double step = 1.0 / n;
+  writeGrids(path, 1, n,
+             [seed, step](size_t, double u, double v, dVector3D& position, dVector3D& normal) {
+               const double x = 2 * u - 1;
+               const double z = 1 - 2 * v;
+               position = dVector3D(x, terrainHeight(x, z, seed), z);
+               const double dx = (terrainHeight(x + step, z, seed) - terrainHeight(x - step, z, seed)) / (2 * step);
+               const double dz = (terrainHeight(x, z + step, seed) - terrainHeight(x, z - step, seed)) / (2 * step);
+               normal = ~dVector3D(-dx, 1, -dz);
+             },
+             options);
+}
+
+// Checkerboard of random colors with darker cell borders, flat cells give
+// RLE long runs like painted textures do.
+static void writeTexture(const std::string& path, size_t size, const generatorOptions_t& options) {
+  size = std::min<size_t>(std::max<size_t>(size, 1), 65535);
+  const size_t cell = std::max<size_t>(1, size / GENERATOR_TEXTURE_CELLS);
+  std::vector<uint8_t> pixels(size * size * 3);
+  for (size_t y = 0; y < size; ++y) {
+    for (size_t x = 0; x < size; ++x) {
+      const int32_t cx = (int32_t)(x / cell);
+      const int32_t cy = (int32_t)(y / cell);
+      const bool border = x % cell == 0 || y % cell == 0;
+      uint8_t* pixel = &pixels[(y * size + x) * 3];
+      for (uint32_t c = 0; c < 3; ++c) {
+        const double value = 64 + 191 * hashNoise(cx, cy, options.seed * 3 + c);
+        pixel[c] = (uint8_t)(border ? value / 2 : value);
+      }
+    }
+  }
+  Tga::Write(path.c_str(), (std::uint32_t)size, (std::uint32_t)size, 24, pixels.data(), !options.raw);
+  std::cout << "wrote " << path << ": " << size << " x " << size << (options.raw ? " raw, " : " RLE, ")
+            << std::filesystem::file_size(path) << " bytes" << std::endl;
+}
+
+static void writeScene(const std::string& directory, size_t models, size_t triangles,
+                       const generatorOptions_t& options) {
+  std::filesystem::create_directories(directory);
+  std::vector<sceneEntry_t> entries;
+  for (size_t i = 0; i < models; ++i) {
+    generatorOptions_t modelOptions = options;
+    modelOptions.seed = options.seed + (uint32_t)i;
+    const std::string obj = "model_" + std::to_string(i) + ".obj";
+    const std::string tga = "texture_" + std::to_string(i) + ".tga";
+    if (i % 2 == 0) {
+      writeSphere(directory + "/" + obj, triangles, modelOptions);
+    } else {
+      writeTerrain(directory + "/" + obj, triangles, modelOptions);
+    }
+    writeTexture(directory + "/" + tga, options.textureSize, modelOptions);
+    entries.push_back({obj, tga, options.instances});
+  }
+  SceneFile::save(directory + "/scene.txt", entries);
+  std::cout << "wrote " << directory << "/scene.txt: " << models << " models, " << models * options.instances
+            << " instances" << std::endl;
+}
+
+static void printUsage() {
+  std::cout << "usage:" << std::endl
+            << "  wavefront_generator sphere <triangles> <out.obj> [--no-uv] [--no-normals]" << std::endl
+            << "  wavefront_generator terrain <triangles> <out.obj> [--no-uv] [--no-normals] [--seed N]"
+            << std::endl
+            << "  wavefront_generator texture <size> <out.tga> [--raw] [--seed N]" << std::endl
+            << "  wavefront_generator scene <directory> <models> <triangles> [--instances N]" << std::endl
+            << "      [--texture-size N] [--raw] [--no-uv] [--no-normals] [--seed N]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  generatorOptions_t options = {true, true, false, 1, 1, 1024};
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--no-uv") {
+      options.uvs = false;
+    } else if (arg == "--no-normals") {
+      options.normals = false;
+    } else if (arg == "--raw") {
+      options.raw = true;
+    } else if (arg == "--seed" && i + 1 < argc) {
+      options.seed = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--instances" && i + 1 < argc) {
+      options.instances = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--texture-size" && i + 1 < argc) {
+      options.textureSize = std::strtoul(argv[++i], nullptr, 10);
+    } else {
+      positional.push_back(arg);
+    }
+  }
+
+  const std::string command = positional.empty() ? "" : positional[0];
+  if ((command == "sphere" || command == "terrain" || command == "texture") && positional.size() == 3) {
+    const size_t size = std::strtoull(positional[1].c_str(), nullptr, 10);
+    if (command == "sphere") {
+      writeSphere(positional[2], size, options);
+    } else if (command == "terrain") {
+      writeTerrain(positional[2], size, options);
+    } else {
+      writeTexture(positional[2], size, options);
+    }
+  } else if (command == "scene" && positional.size() == 4) {
+    writeScene(positional[1], std::strtoul(positional[2].c_str(), nullptr, 10),
+               std::strtoull(positional[3].c_str(), nullptr, 10), options);
+  } else {
+    printUsage();
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,328 @@
+// Checks conservative occlusion culling against a 1024x1024 reference depth
+// buffer of the same occluders: no box the reference sees past them may be
+// culled. The synthetic cases put boxes behind gaps narrower than a buffer
+// pixel, next to faces touching only at a vertex and in the holes of meshes
+// whose faces are smaller than a pixel, the models given on the command line
+// test the meshlets of a grid of instances behind each other.
+//
+//   occlusion_check [model.obj]...
+//
+// Exits with 1 when a visible box was culled.
+#include <stdint.h>
+
+#include <array>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "meshlets.hpp"
+#include "occlusion.hpp"
+#include "wavefront_loader.hpp"
+
+#define CHECK_REFERENCE_SIZE 1024
+#define CHECK_FOV 60.0
+#define CHECK_NEAR 0.1
+#define CHECK_FAR 100.0
+
+typedef std::array<double, 16> matrix_t;
+
+typedef struct {
+  std::shared_ptr<Object3D> model;
+  matrix_t clip;
+} checkOccluder_t;
+
+typedef struct {
+  matrix_t clip;
+  dVector3D lo;
+  dVector3D hi;
+} checkProbe_t;
+
+typedef struct {
+  std::string name;
+  std::vector<checkOccluder_t> occluders;
+  std::vector<checkProbe_t> probes;
+} checkCase_t;
+
+static matrix_t getProjection() {
+  const double f = 1.0 / std::tan(CHECK_FOV * 0.5 * PI / 180.0);
+  const double n = CHECK_NEAR, fa = CHECK_FAR;
+  return {f, 0, 0, 0, 0, f, 0, 0, 0, 0, (fa + n) / (n - fa), -1, 0, 0, 2 * fa * n / (n - fa), 0};
+}
+
+// Size in eye space of an occlusion buffer pixel at `distance`.
+static double getPixelSize(double distance) {
+  return 2.0 * distance * std::tan(CHECK_FOV * 0.5 * PI / 180.0) / OCCLUSION_HEIGHT;
+}
+
+// `columns` x `rows` cells of two counter clockwise faces each between the
+// points of `point` at (u, v) in [0, 1], skipping the cells `keep` refuses.
+static std::shared_ptr<Object3D> makeGrid(size_t columns, size_t rows,
+                                          const std::function<dVector3D(double u, double v)>& point,
+                                          const std::function<bool(size_t column, size_t row)>& keep) {
+  std::shared_ptr<Object3D> model = std::make_shared<Object3D>();
+  auto at = [&](size_t column, size_t row) { return point((double)column / columns, (double)row / rows); };
+  for (size_t row = 0; row < rows; ++row) {
+    for (size_t column = 0; column < columns; ++column) {
+      if (!keep(column, row)) continue;
+      ObjectFace3D face;
+      face.p0 = at(column, row);
+      face.p1 = at(column + 1, row);
+      face.p2 = at(column + 1, row + 1);
+      model->faces.push_back(face);
+      face.p1 = face.p2;
+      face.p2 = at(column, row + 1);
+      model->faces.push_back(face);
+    }
+  }
+  model->computeBounds();
+  return model;
+}
+
+static void addProbe(checkCase_t& check, const dVector3D& center, double halfSize) {
+  const dVector3D extent(halfSize, halfSize, halfSize);
+  check.probes.push_back({getProjection(), center - extent, center + extent});
+}
+
+// Two quads `width` pixels apart, at sub-pixel offsets.
+static checkCase_t makeGapCase(double width, double offset) {
+  checkCase_t check;
+  check.name = "gap of " + std::to_string(width) + " px at " + std::to_string(offset);
+  const double distance = 3, pixel = getPixelSize(distance);
+  const double left = (offset - 0.5 * width) * pixel, right = (offset + 0.5 * width) * pixel;
+  for (const double side : {-1.0, 1.0}) {
+    const double inner = side < 0 ? left : right;
+    std::shared_ptr<Object3D> quad = makeGrid(
+        8, 8,
+        [&](double u, double v) {
+          const double x = side < 0 ? -40 * pixel + u * (inner + 40 * pixel) : inner + u * (40 * pixel - inner);
+          return dVector3D(x, (v - 0.5) * 60 * pixel, -distance);
+        },
+        [](size_t, size_t) { return true; });
+    check.occluders.push_back({quad, getProjection()});
+  }
+  // Behind the gap and behind both quads, under a third of a pixel wide so
+  // they hold a reference pixel center but fit in the gap.
+  const double behind = 5, scale = behind / distance;
+  for (int row = -20; row <= 20; row += 4) {
+    for (const double x : {0.5 * (left + right), -10 * pixel, 10 * pixel}) {
+      addProbe(check, dVector3D(x * scale, row * pixel * scale, -behind), 0.14 * pixel * scale);
+    }
+  }
+  return check;
+}
+
+// Two triangles of one mesh meeting at a single vertex, boxes in the wedges
+// between them close to it.
+static checkCase_t makeVertexCase() {
+  checkCase_t check;
+  check.name = "faces touching at a vertex";
+  const double distance = 3, pixel = getPixelSize(distance);
+  const dVector3D apex(0.31 * pixel, 0.17 * pixel, -distance);
+  std::shared_ptr<Object3D> model = std::make_shared<Object3D>();
+  ObjectFace3D face;
+  face.p0 = apex;
+  face.p1 = apex + dVector3D(-30 * pixel, 20 * pixel, 0);
+  face.p2 = apex + dVector3D(-30 * pixel, -20 * pixel, 0);
+  model->faces.push_back(face);
+  face.p1 = apex + dVector3D(30 * pixel, -20 * pixel, 0);
+  face.p2 = apex + dVector3D(30 * pixel, 20 * pixel, 0);
+  model->faces.push_back(face);
+  model->computeBounds();
+  check.occluders.push_back({model, getProjection()});
+
+  const double behind = 5, scale = behind / distance;
+  for (const double y : {-2.0, -1.0, -0.5, 0.5, 1.0, 2.0}) {
+    for (const double x : {0.0, 0.25 * y, -0.25 * y}) {
+      const dVector3D center(apex.x() + x * pixel, apex.y() + y * pixel, -distance);
+      addProbe(check, center * scale, 0.14 * pixel * scale);
+    }
+  }
+  return check;
+}
+
+// Faces of a third of a pixel on a steep plane, with scattered missing cells
+// and a diagonal of them only joined at their corners.
+static checkCase_t makeSubPixelCase() {
+  checkCase_t check;
+  check.name = "sub-pixel faces";
+  const size_t cells = 240;
+  const double distance = 3, pixel = getPixelSize(distance);
+  auto point = [&](double u, double v) {
+    return dVector3D((u - 0.5) * 80 * pixel, (v - 0.5) * 80 * pixel, -distance - 4 * u);
+  };
+  auto isHole = [&](size_t column, size_t row) {
+    return column == row || ((column * 7919 + row * 104729) % 97) == 0;
+  };
+  std::shared_ptr<Object3D> model = makeGrid(cells, cells, point, [&](size_t c, size_t r) { return !isHole(c, r); });
+  check.occluders.push_back({model, getProjection()});
+
+  // Just behind the plane in the middle of every hole, and behind cells
+  // that are there.
+  for (size_t row = 0; row < cells; ++row) {
+    for (size_t column = 0; column < cells; column += 3) {
+      if (!isHole(column, row) && (row + column) % 29 != 0) continue;
+      const dVector3D center = point((column + 0.5) / cells, (row + 0.5) / cells);
+      addProbe(check, center * 1.05, 0.14 * getPixelSize(-center.z()));
+    }
+  }
+  return check;
+}
+
+// Instances of `path` on a grid behind one close to the camera, a box for
+// every meshlet of every instance.
+static checkCase_t makeModelCase(const std::string& path) {
+  checkCase_t check;
+  check.name = path;
+  std::shared_ptr<Object3D> model = std::make_shared<Object3D>(WavefrontObjLoader::loadObjWavefrontObj(path));
+  Meshlets::buildModel(*model);
+  model->computeBounds();
+
+  std::vector<Instance3D> instances;
+  for (int i = 0; i < 25; ++i) {
+    Instance3D instance(model);
+    instance.position = dVector3D((i % 5 - 2) * 0.7, (i / 5 - 2) * 0.7, -6 - (i % 3));
+    instance.rotation = i * 37;
+    instances.push_back(instance);
+  }
+  Instance3D front(model);
+  front.position = dVector3D(0, 0, -2.5);
+  instances.push_back(front);
+
+  const matrix_t projection = getProjection();
+  for (const Instance3D& instance : instances) {
+    double transform[16];
+    matrix_t clip;
+    instance.getTransform(transform);
+    mat4::multiply(projection.data(), transform, clip.data());
+    check.occluders.push_back({model, clip});
+    for (const meshlet_t& meshlet : model->meshlets[0]) {
+      const dVector3D extent(meshlet.radius, meshlet.radius, meshlet.radius);
+      check.probes.push_back({clip, meshlet.center - extent, meshlet.center + extent});
+    }
+  }
+  return check;
+}
+
+// Reference pixels, x and y in reference pixels and z in NDC.
+static bool projectReference(const matrix_t& clip, const dVector3D& p, double out[3]) {
+  const double v[4] = {p.x(), p.y(), p.z(), 1};
+  double c[4];
+  mat4::transform(clip.data(), v, c);
+  if (c[3] < OCCLUSION_MIN_W) return false;
+  out[0] = (c[0] / c[3] * 0.5 + 0.5) * CHECK_REFERENCE_SIZE;
+  out[1] = (c[1] / c[3] * 0.5 + 0.5) * CHECK_REFERENCE_SIZE;
+  out[2] = c[2] / c[3];
+  return true;
+}
+
+// Nearest depth at every reference pixel center, both windings.
+static std::vector<double> renderReference(const checkCase_t& check) {
+  const int size = CHECK_REFERENCE_SIZE;
+  std::vector<double> depth((size_t)size * size, 1.0);
+  for (const checkOccluder_t& occluder : check.occluders) {
+    for (const ObjectFace3D& face : occluder.model->faces) {
+      double s[3][3];
+      if (!projectReference(occluder.clip, face.p0, s[0]) || !projectReference(occluder.clip, face.p1, s[1]) ||
+          !projectReference(occluder.clip, face.p2, s[2])) {
+        continue;
+      }
+      const double area = (s[1][0] - s[0][0]) * (s[2][1] - s[0][1]) - (s[2][0] - s[0][0]) * (s[1][1] - s[0][1]);
+      if (area == 0) continue;
+      const int x0 = std::max(0, (int)std::floor(std::min({s[0][0], s[1][0], s[2][0]})));
+      const int x1 = std::min(size - 1, (int)std::floor(std::max({s[0][0], s[1][0], s[2][0]})));
+      const int y0 = std::max(0, (int)std::floor(std::min({s[0][1], s[1][1], s[2][1]})));
+      const int y1 = std::min(size - 1, (int)std::floor(std::max({s[0][1], s[1][1], s[2][1]})));
+      for (int y = y0; y <= y1; ++y) {
+        for (int x = x0; x <= x1; ++x) {
+          const double px = x + 0.5, py = y + 0.5;
+          const double w0 = ((s[1][0] - px) * (s[2][1] - py) - (s[2][0] - px) * (s[1][1] - py)) / area;
+          const double w1 = ((s[2][0] - px) * (s[0][1] - py) - (s[0][0] - px) * (s[2][1] - py)) / area;
+          const double w2 = 1 - w0 - w1;
+          if (w0 < 0 || w1 < 0 || w2 < 0) continue;
+          double& stored = depth[(size_t)y * size + x];
+          stored = std::min(stored, w0 * s[0][2] + w1 * s[1][2] + w2 * s[2][2]);
+        }
+      }
+    }
+  }
+  return depth;
+}
+
+// 1 when some reference pixel center inside the box's bounds sees past the
+// occluders to its nearest depth, 0 when none does, -1 when the box holds
+// no center or crosses the near plane.
+static int isVisibleInReference(const std::vector<double>& depth, const checkProbe_t& probe) {
+  double minX = INFINITY, minY = INFINITY, minZ = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+  for (int corner = 0; corner < 8; ++corner) {
+    const dVector3D p(corner & 1 ? probe.hi.x() : probe.lo.x(), corner & 2 ? probe.hi.y() : probe.lo.y(),
+                      corner & 4 ? probe.hi.z() : probe.lo.z());
+    double s[3];
+    if (!projectReference(probe.clip, p, s)) return -1;
+    minX = std::min(minX, s[0]);
+    maxX = std::max(maxX, s[0]);
+    minY = std::min(minY, s[1]);
+    maxY = std::max(maxY, s[1]);
+    minZ = std::min(minZ, s[2]);
+  }
+  if (minZ < -1.0) return -1;
+  const int x0 = std::max(0, (int)std::ceil(minX - 0.5)), x1 = std::min(CHECK_REFERENCE_SIZE - 1, (int)std::floor(maxX - 0.5));
+  const int y0 = std::max(0, (int)std::ceil(minY - 0.5)), y1 = std::min(CHECK_REFERENCE_SIZE - 1, (int)std::floor(maxY - 0.5));
+  if (x0 > x1 || y0 > y1) return -1;
+  for (int y = y0; y <= y1; ++y) {
+    for (int x = x0; x <= x1; ++x) {
+      if (minZ <= depth[(size_t)y * CHECK_REFERENCE_SIZE + x]) return 1;
+    }
+  }
+  return 0;
+}
+
+// Number of boxes visible in the reference that the buffer culls.
+static size_t runCase(const checkCase_t& check) {
+  OcclusionBuffer occlusion;
+  occlusion.mode = OCCLUSION_CONSERVATIVE;
+  occlusion.clear();
+  for (const checkOccluder_t& occluder : check.occluders) {
+    const std::vector<faceRange_t> ranges = {{0, (uint32_t)occluder.model->faces.size(), UINT32_MAX}};
+    occlusion.addOccluder(occluder.clip.data(), *occluder.model, 0, ranges);
+  }
+  occlusion.rasterize();
+  const std::vector<double> reference = renderReference(check);
+
+  size_t tested = 0, visible = 0, culled = 0, wrong = 0;
+  for (const checkProbe_t& probe : check.probes) {
+    const int expected = isVisibleInReference(reference, probe);
+    if (expected < 0) continue;
+    tested++;
+    visible += expected;
+    if (occlusion.isBoxVisible(probe.clip.data(), probe.lo, probe.hi)) continue;
+    culled++;
+    if (expected) {
+      wrong++;
+      std::cout << "  culled visible box at " << (probe.lo + probe.hi) * 0.5 << std::endl;
+    }
+  }
+  std::cout << check.name << ": " << tested << " boxes, " << visible << " visible in the reference, " << culled
+            << " culled, " << wrong << " of them visible" << std::endl;
+  return wrong;
+}
+
+int main(int argc, char** argv) {
+  std::vector<checkCase_t> checks;
+  for (const double width : {0.3, 0.6}) {
+    for (const double offset : {0.05, 0.37, 0.71}) checks.push_back(makeGapCase(width, offset));
+  }
+  checks.push_back(makeVertexCase());
+  checks.push_back(makeSubPixelCase());
+  for (int i = 1; i < argc; ++i) checks.push_back(makeModelCase(argv[i]));
+
+  size_t wrong = 0;
+  for (const checkCase_t& check : checks) wrong += runCase(check);
+  if (wrong > 0) {
+    std::cout << wrong << " visible boxes culled" << std::endl;
+    return 1;
+  }
+  return 0;
+}